@@ -0,0 +1,160 @@
+#include "asset_pack.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char* pack_base                  = NULL;
+static const asset_pack_header_t* pack_header = NULL;
+static const uint32_t* pack_slots             = NULL;
+static const asset_pack_entry_t* pack_entries = NULL;
+static const char* pack_strings               = NULL;
+
+uint64_t asset_pack_hash(const char* path, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int range_valid(uint64_t offset, uint64_t length, uint64_t limit) {
+    return offset <= limit && length <= limit - offset;
+}
+
+static int string_valid(uint32_t offset, const asset_pack_header_t* header,
+                        const char* strings) {
+    return offset < header->strings_size &&
+           memchr(strings + offset, '\0', header->strings_size - offset);
+}
+
+// Check every offset in the pack once, so lookups can trust them
+static int validate_pack(const char* base, size_t size) {
+    if (size < sizeof(asset_pack_header_t))
+        return -1;
+
+    const asset_pack_header_t* header = (const asset_pack_header_t*)base;
+    if (header->magic != ASSET_PACK_MAGIC ||
+        header->version != ASSET_PACK_VERSION || header->num_slots == 0 ||
+        (header->num_slots & (header->num_slots - 1)) != 0 ||
+        header->num_entries >= header->num_slots)
+        return -1;
+
+    if (!range_valid(header->slots_offset,
+                     (uint64_t)header->num_slots * sizeof(uint32_t), size) ||
+        !range_valid(header->entries_offset,
+                     (uint64_t)header->num_entries * sizeof(asset_pack_entry_t),
+                     size) ||
+        !range_valid(header->strings_offset, header->strings_size, size))
+        return -1;
+
+    // Lookups probe until they reach an empty slot, so there must be one
+    // even if a slot refers to an entry twice
+    const uint32_t* slots = (const uint32_t*)(base + header->slots_offset);
+    uint32_t used         = 0;
+    for (uint32_t i = 0; i < header->num_slots; i++) {
+        if (slots[i] > header->num_entries)
+            return -1;
+        used += slots[i] != 0;
+    }
+    if (used >= header->num_slots)
+        return -1;
+
+    const asset_pack_entry_t* entries =
+        (const asset_pack_entry_t*)(base + header->entries_offset);
+    const char* strings = base + header->strings_offset;
+    for (uint32_t i = 0; i < header->num_entries; i++) {
+        const asset_pack_entry_t* entry = &entries[i];
+        if (!string_valid(entry->path_offset, header, strings) ||
+            !string_valid(entry->mime_offset, header, strings) ||
+            !string_valid(entry->etag_offset, header, strings) ||
+            !range_valid(entry->data_offset, entry->data_length, size) ||
+            !range_valid(entry->gzip_offset, entry->gzip_length, size))
+            return -1;
+    }
+
+    return 0;
+}
+
+int asset_pack_open(const char* filename, int lock) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Failed to open asset pack");
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Invalid asset pack %s\n", filename);
+        close(fd);
+        return 1;
+    }
+
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                      fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("Failed to map asset pack");
+        return 1;
+    }
+
+    if (validate_pack(base, st.st_size) != 0) {
+        fprintf(stderr, "Corrupt asset pack %s\n", filename);
+        munmap(base, st.st_size);
+        return 1;
+    }
+
+    // Keep assets resident so lookups never fault to disk. Failing to lock
+    // (e.g. RLIMIT_MEMLOCK) only costs latency.
+    if (lock && mlock(base, st.st_size) < 0)
+        perror("Warning: failed to lock asset pack in memory");
+
+    pack_base    = base;
+    pack_header  = (const asset_pack_header_t*)pack_base;
+    pack_slots   = (const uint32_t*)(pack_base + pack_header->slots_offset);
+    pack_entries =
+        (const asset_pack_entry_t*)(pack_base + pack_header->entries_offset);
+    pack_strings = pack_base + pack_header->strings_offset;
+
+    printf("Loaded %u assets from %s\n", pack_header->num_entries, filename);
+    return 0;
+}
+
+int asset_pack_loaded(void) {
+    return pack_base != NULL;
+}
+
+int asset_pack_find(const char* path, asset_t* asset) {
+    if (!pack_base || !path || !asset)
+        return -1;
+
+    size_t length = strlen(path);
+    uint64_t hash = asset_pack_hash(path, length);
+    uint32_t mask = pack_header->num_slots - 1;
+
+    // validate_pack() made sure the table has an empty slot, so probing
+    // always ends
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        uint32_t slot = pack_slots[i];
+        if (slot == 0)
+            return -1;
+
+        const asset_pack_entry_t* entry = &pack_entries[slot - 1];
+        if (entry->hash != hash ||
+            strcmp(pack_strings + entry->path_offset, path) != 0)
+            continue;
+
+        asset->path        = pack_strings + entry->path_offset;
+        asset->mime_type   = pack_strings + entry->mime_offset;
+        asset->etag        = pack_strings + entry->etag_offset;
+        asset->data        = pack_base + entry->data_offset;
+        asset->length      = entry->data_length;
+        asset->gzip_data   = pack_base + entry->gzip_offset;
+        asset->gzip_length = entry->gzip_length;
+        return 0;
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef ASSET_PACK_H
+#define ASSET_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// On-disk layout of a static asset pack, as written by pack_assets:
+//
+//   header | slots | entries | strings | page-aligned file contents
+//
+// The slots form an open-addressing hash table of entry indexes (plus one,
+// zero marks an empty slot) keyed by the hash of the asset path.
+
+#define ASSET_PACK_MAGIC 0x4b504853  // "SHPK"
+#define ASSET_PACK_VERSION 1
+#define ASSET_PACK_ALIGNMENT 4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;  // Power of two
+    uint32_t num_entries;
+    uint64_t slots_offset;
+    uint64_t entries_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+} asset_pack_header_t;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t path_offset;  // Offsets into the string table
+    uint32_t mime_offset;
+    uint32_t etag_offset;
+    uint32_t reserved;
+    uint64_t data_offset;  // Offsets from the start of the pack
+    uint64_t data_length;
+    uint64_t gzip_offset;  // Precompressed variant, gzip_length 0 if none
+    uint64_t gzip_length;
+} asset_pack_entry_t;
+
+// An asset found in the loaded pack. All pointers point into the mapping.
+typedef struct {
+    const char* path;
+    const char* mime_type;
+    const char* etag;
+    const char* data;
+    size_t length;
+    const char* gzip_data;
+    size_t gzip_length;
+} asset_t;
+
+/**
+ * Hash an asset path (64-bit FNV-1a)
+ * @param path Path relative to the static directory
+ * @param length Length of the path
+ * @return The hash value
+ */
+uint64_t asset_pack_hash(const char* path, size_t length);
+
+/**
+ * Map an asset pack into memory for the lifetime of the process
+ * @param filename Pack file to load
+ * @param lock Whether to mlock() the mapping
+ * @return 0 on success, non-zero on error
+ */
+int asset_pack_open(const char* filename, int lock);
+
+/**
+ * Check whether an asset pack has been loaded
+ * @return 1 if a pack is loaded, 0 otherwise
+ */
+int asset_pack_loaded(void);
+
+/**
+ * Look up an asset in the loaded pack
+ * @param path Path relative to the static directory
+ * @param asset Filled with the asset on success
+ * @return 0 if found, non-zero otherwise
+ */
+int asset_pack_find(const char* path, asset_t* asset);
+
+#endif /* ASSET_PACK_H */
@@ -0,0 +1,83 @@
+// Times parse_request() with each header scanning kernel the CPU supports.
+// Includes scan.c to switch kernels. Run by `make bench`.
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../request.h"
+#include "../scan.c"
+
+#define ITERATIONS 200000
+
+// What a browser sends for a page
+static const char browser_request[] =
+    "GET /static/index.html?utm_source=newsletter HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+    "\"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=4f1c2a9e7b3d4e8f9a0b1c2d3e4f5a6b; theme=dark; "
+    "_ga=GA1.1.123456789.1700000000; _gid=GA1.1.987654321.1700000000\r\n"
+    "\r\n";
+
+// The same request behind a proxy that adds long forwarding headers
+static char long_request[4096];
+
+static double now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static void run(const char* name, const char* buffer) {
+    static http_request_t request;
+    int errors = 0;
+
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++)
+        errors += parse_request(buffer, &request) != 0;
+    double elapsed = now_ns() - start;
+
+    printf("%-8s %-8s %5zu bytes  %7.1f ns/request%s\n", name,
+           scan_kernel_name(), strlen(buffer), elapsed / ITERATIONS,
+           errors ? "  (parse errors)" : "");
+}
+
+static void run_with(find_special_fn find_special) {
+    atomic_store(&kernel, find_special);
+    run("browser", browser_request);
+    run("proxied", long_request);
+}
+
+int main(void) {
+    size_t length = sizeof(browser_request) - 3;  // Before the final CRLF
+    memcpy(long_request, browser_request, length);
+    snprintf(long_request + length, sizeof(long_request) - length,
+             "X-Forwarded-For: %s\r\nX-Request-Trace: %0600d\r\n"
+             "X-Client-Certificate: %0900d\r\n\r\n",
+             "203.0.113.7, 198.51.100.23, 192.0.2.41", 0, 0);
+
+    run_with(find_special_scalar);
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        run_with(find_special_sse42);
+    if (__builtin_cpu_supports("avx2"))
+        run_with(find_special_avx2);
+#endif
+    return 0;
+}
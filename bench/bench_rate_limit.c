@@ -0,0 +1,76 @@
+// Times rate_limit_allow() for one busy client, for more clients than the
+// table holds (so lookups evict), with a route, and from several threads
+// sharing one bucket. Run by `make bench`.
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../rate_limit.h"
+
+#define ITERATIONS 2000000
+#define THREADS 4
+
+static volatile int sink;
+
+static double now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// Client i of n, as an address in network byte order
+static uint32_t client(int i, int clients) {
+    return htonl(0x0a000000u + (uint32_t)(i % clients));
+}
+
+static void run(const char* name, int clients, const char* route) {
+    size_t route_length = route ? strlen(route) : 0;
+    int allowed         = 0;
+
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++)
+        allowed += rate_limit_allow(client(i, clients), route, route_length);
+    double elapsed = now_ns() - start;
+
+    sink = allowed;
+    printf("%-22s %8d clients  %6.1f ns/check\n", name, clients,
+           elapsed / ITERATIONS);
+}
+
+static void* run_thread(void* arg) {
+    (void)arg;
+    int allowed = 0;
+    for (int i = 0; i < ITERATIONS; i++)
+        allowed += rate_limit_allow(client(0, 1), NULL, 0);
+    sink = allowed;
+    return NULL;
+}
+
+// Every thread takes tokens from the same bucket, the worst case for the
+// compare-and-swap on its state
+static void run_contended(void) {
+    pthread_t threads[THREADS];
+
+    double start = now_ns();
+    for (int i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, run_thread, NULL);
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = now_ns() - start;
+
+    printf("%-22s %8d clients  %6.1f ns/check (%d threads)\n", "contended",
+           1, elapsed / ITERATIONS, THREADS);
+}
+
+int main(void) {
+    rate_limit_init(1000000, 1000000, 1000000);
+
+    run("one client", 1, NULL);
+    run("table sized", RATE_LIMIT_TABLE_SIZE / 2, NULL);
+    run("evicting", RATE_LIMIT_TABLE_SIZE * 4, NULL);
+    run("client and route", 1024, "/static/");
+    run_contended();
+    return 0;
+}
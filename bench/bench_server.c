@@ -0,0 +1,274 @@
+// Load generator for comparing listeners and socket options. Starts the
+// server command given after "--", sends sequential requests to each target
+// on a new connection each (the server closes every HTTP/1 connection after
+// one response), and prints the request rate and latency. Run by
+// `make bench`.
+//
+// Usage: bench_server [-n requests] [-r path] [-F] [-l label]
+//                     -t tcp:port|unix:path... -- server command...
+#define _GNU_SOURCE
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_REQUESTS 20000
+#define WARMUP_REQUESTS 500
+#define MAX_TARGETS 4
+#define STARTUP_TIMEOUT_MS 3000
+#define RESPONSE_SIZE 65536
+
+typedef struct {
+    const char* spec;
+    struct sockaddr_storage addr;
+    socklen_t addr_length;
+} target_t;
+
+static target_t targets[MAX_TARGETS];
+static int num_targets = 0;
+
+static char request[512];
+static char response[RESPONSE_SIZE];
+
+static double now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+// Parse "tcp:port" (loopback) or "unix:path"
+static int parse_target(const char* spec, target_t* target) {
+    memset(target, 0, sizeof(target_t));
+    target->spec = spec;
+
+    if (strncmp(spec, "tcp:", 4) == 0) {
+        struct sockaddr_in* in = (struct sockaddr_in*)&target->addr;
+        in->sin_family         = AF_INET;
+        in->sin_port           = htons(atoi(spec + 4));
+        in->sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+        target->addr_length    = sizeof(struct sockaddr_in);
+        return 0;
+    }
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un* un = (struct sockaddr_un*)&target->addr;
+        if (strlen(spec + 5) >= sizeof(un->sun_path))
+            return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, spec + 5);
+        target->addr_length = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    return -1;
+}
+
+// Open a connection and send the request. With fastopen the request goes
+// out with the SYN on TCP targets.
+static int open_and_send(const target_t* target, int fastopen) {
+    int fd = socket(target->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    size_t length = strlen(request);
+    ssize_t sent;
+    if (fastopen && target->addr.ss_family == AF_INET) {
+        sent = sendto(fd, request, length, MSG_FASTOPEN | MSG_NOSIGNAL,
+                      (const struct sockaddr*)&target->addr,
+                      target->addr_length);
+    } else {
+        if (connect(fd, (const struct sockaddr*)&target->addr,
+                    target->addr_length) < 0) {
+            close(fd);
+            return -1;
+        }
+        sent = send(fd, request, length, MSG_NOSIGNAL);
+    }
+
+    if (sent != (ssize_t)length) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Read one response. Returns 0 if it was complete, -1 otherwise.
+static int read_response(int fd) {
+    size_t buffered = 0;  // Bytes in the buffer, which only keeps headers
+    size_t received = 0;
+    size_t end      = 0;  // Where the body ends, 0 until the headers are in
+
+    for (;;) {
+        if (buffered == sizeof(response)) {
+            if (end == 0)
+                return -1;
+            buffered = 0;
+        }
+        ssize_t bytes = recv(fd, response + buffered,
+                             sizeof(response) - buffered, 0);
+        if (bytes <= 0)
+            return -1;
+        buffered += bytes;
+        received += bytes;
+
+        if (end == 0) {
+            char* headers_end = memmem(response, buffered, "\r\n\r\n", 4);
+            if (!headers_end)
+                continue;
+            char* length = memmem(response, headers_end - response,
+                                  "Content-Length:", 15);
+            if (!length)
+                return -1;
+            end = headers_end + 4 - response + strtoll(length + 15, NULL, 10);
+        }
+        if (received >= end)
+            return 0;
+    }
+}
+
+// Send one request and read its response
+static int run_request(const target_t* target, int fastopen) {
+    int fd = open_and_send(target, fastopen);
+    if (fd < 0)
+        return -1;
+    int result = read_response(fd);
+    close(fd);
+    return result;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void run(const char* label, const target_t* target, int fastopen,
+                int requests, double* latencies) {
+    int errors = 0;
+
+    for (int i = 0; i < WARMUP_REQUESTS; i++)
+        run_request(target, fastopen);
+
+    double start = now_us();
+    for (int i = 0; i < requests; i++) {
+        double sent = now_us();
+        if (run_request(target, fastopen) != 0)
+            errors++;
+        latencies[i] = now_us() - sent;
+    }
+    double elapsed = now_us() - start;
+
+    qsort(latencies, requests, sizeof(double), compare_doubles);
+    printf("%-20s %-34s %7.0f req/s  p50 %6.1f us  p99 %6.1f us", label,
+           target->spec, requests / (elapsed / 1e6), latencies[requests / 2],
+           latencies[requests * 99 / 100]);
+    if (errors)
+        printf("  (%d errors)", errors);
+    printf("\n");
+}
+
+// Wait until the server accepts connections on every target
+static int wait_for_server(pid_t server) {
+    for (int waited = 0; waited < STARTUP_TIMEOUT_MS; waited += 10) {
+        int ready = 1;
+        for (int i = 0; i < num_targets && ready; i++) {
+            int fd = socket(targets[i].addr.ss_family, SOCK_STREAM, 0);
+            ready  = fd >= 0 && connect(fd,
+                                       (struct sockaddr*)&targets[i].addr,
+                                       targets[i].addr_length) == 0;
+            if (fd >= 0)
+                close(fd);
+        }
+        if (ready)
+            return 0;
+        if (waitpid(server, NULL, WNOHANG) == server)
+            return -1;
+        usleep(10000);
+    }
+    return -1;
+}
+
+static void usage(const char* program_name) {
+    fprintf(stderr,
+            "Usage: %s [-n requests] [-r path] [-F] [-l label] "
+            "-t tcp:port|unix:path... -- server command...\n",
+            program_name);
+}
+
+int main(int argc, char* argv[]) {
+    int requests      = DEFAULT_REQUESTS;
+    const char* path  = "/calc/add/5/3";
+    const char* label = "";
+    int fastopen      = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:Fl:t:")) != -1) {
+        switch (opt) {
+            case 'n':
+                requests = atoi(optarg);
+                break;
+            case 'r':
+                path = optarg;
+                break;
+            case 'F':
+                fastopen = 1;
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            case 't':
+                if (num_targets == MAX_TARGETS ||
+                    parse_target(optarg, &targets[num_targets]) != 0) {
+                    fprintf(stderr, "Invalid target %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                num_targets++;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (requests <= 0 || num_targets == 0 || optind >= argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    snprintf(request, sizeof(request),
+             "GET %s HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n",
+             path);
+
+    // The server logs every connection, which would drown the results
+    pid_t server = fork();
+    if (server == 0) {
+        freopen("/dev/null", "w", stdout);
+        execvp(argv[optind], argv + optind);
+        perror("Failed to start server");
+        _exit(127);
+    }
+    if (server < 0 || wait_for_server(server) != 0) {
+        fprintf(stderr, "Server did not start\n");
+        if (server > 0)
+            kill(server, SIGTERM);
+        return EXIT_FAILURE;
+    }
+
+    double* latencies = malloc(requests * sizeof(double));
+    if (!latencies) {
+        kill(server, SIGTERM);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < num_targets; i++)
+        run(label, &targets[i], fastopen, requests, latencies);
+
+    free(latencies);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+#include "buffer_pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_CLASS_SHIFT 10
+#define NUM_CLASSES 9
+#define SLAB_SIZE (64 * 1024)
+#define CACHE_LIMIT 8  // Buffers a thread keeps per class before sharing
+#define CACHE_BATCH 4  // Buffers moved from the shared lists at a time
+
+// Free buffers are linked through their own first bytes
+typedef struct free_buffer {
+    struct free_buffer* next;
+} free_buffer_t;
+
+typedef struct {
+    free_buffer_t* head;
+    int count;
+} free_list_t;
+
+// Shared free lists, one per size class
+static free_list_t shared_lists[NUM_CLASSES];
+static pthread_mutex_t shared_locks[NUM_CLASSES] = {
+    [0 ... NUM_CLASSES - 1] = PTHREAD_MUTEX_INITIALIZER};
+
+// Per-thread caches, flushed to the shared lists when the thread exits
+static __thread free_list_t thread_cache[NUM_CLASSES];
+static __thread int thread_registered = 0;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static size_t class_size(int size_class) {
+    return (size_t)1 << (size_class + MIN_CLASS_SHIFT);
+}
+
+static int class_for_size(size_t size) {
+    for (int i = 0; i < NUM_CLASSES; i++)
+        if (class_size(i) >= size)
+            return i;
+    return -1;
+}
+
+static void push(free_list_t* list, free_buffer_t* buffer) {
+    buffer->next = list->head;
+    list->head   = buffer;
+    list->count++;
+}
+
+static free_buffer_t* pop(free_list_t* list) {
+    free_buffer_t* buffer = list->head;
+    if (buffer) {
+        list->head = buffer->next;
+        list->count--;
+    }
+    return buffer;
+}
+
+// Move up to count buffers from one list to another
+static void transfer(free_list_t* from, free_list_t* to, int count) {
+    while (count-- > 0 && from->head)
+        push(to, pop(from));
+}
+
+static void flush_thread_cache(void* arg) {
+    (void)arg;
+
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        if (!thread_cache[i].head)
+            continue;
+        pthread_mutex_lock(&shared_locks[i]);
+        transfer(&thread_cache[i], &shared_lists[i], thread_cache[i].count);
+        pthread_mutex_unlock(&shared_locks[i]);
+    }
+}
+
+static void create_cache_key(void) {
+    pthread_key_create(&cache_key, flush_thread_cache);
+}
+
+// Make sure this thread's cache is flushed when it exits
+static void register_thread(void) {
+    if (thread_registered)
+        return;
+
+    pthread_once(&cache_key_once, create_cache_key);
+    pthread_setspecific(cache_key, thread_cache);
+    thread_registered = 1;
+}
+
+// Refill the thread cache from the shared list, or carve a new slab
+static int refill(int size_class) {
+    free_list_t* cache = &thread_cache[size_class];
+
+    pthread_mutex_lock(&shared_locks[size_class]);
+    transfer(&shared_lists[size_class], cache, CACHE_BATCH);
+    pthread_mutex_unlock(&shared_locks[size_class]);
+
+    if (cache->head)
+        return 0;
+
+    size_t size      = class_size(size_class);
+    size_t slab_size = size > SLAB_SIZE ? size : SLAB_SIZE;
+    char* slab       = malloc(slab_size);
+    if (!slab)
+        return -1;
+
+    // Slabs are never freed; their buffers cycle through the free lists
+    for (size_t offset = 0; offset + size <= slab_size; offset += size)
+        push(cache, (free_buffer_t*)(slab + offset));
+
+    return 0;
+}
+
+int buffer_pool_acquire(pool_buffer_t* buffer, size_t min_size) {
+    if (!buffer)
+        return -1;
+
+    int size_class = class_for_size(min_size);
+    if (size_class < 0)
+        return -1;
+
+    register_thread();
+
+    if (!thread_cache[size_class].head && refill(size_class) != 0)
+        return -1;
+
+    buffer->data       = (char*)pop(&thread_cache[size_class]);
+    buffer->size       = class_size(size_class);
+    buffer->size_class = size_class;
+    return 0;
+}
+
+int buffer_pool_grow(pool_buffer_t* buffer, size_t used, size_t min_size) {
+    if (!buffer)
+        return -1;
+
+    pool_buffer_t larger;
+    if (buffer_pool_acquire(&larger, min_size) != 0)
+        return -1;
+
+    if (buffer->data) {
+        memcpy(larger.data, buffer->data, used);
+        buffer_pool_release(buffer);
+    }
+
+    *buffer = larger;
+    return 0;
+}
+
+void buffer_pool_release(pool_buffer_t* buffer) {
+    if (!buffer || !buffer->data)
+        return;
+
+    int size_class     = buffer->size_class;
+    free_list_t* cache = &thread_cache[size_class];
+
+    register_thread();
+    push(cache, (free_buffer_t*)buffer->data);
+
+    // Share surplus buffers so other threads can reuse them
+    if (cache->count > CACHE_LIMIT) {
+        pthread_mutex_lock(&shared_locks[size_class]);
+        transfer(cache, &shared_lists[size_class], CACHE_LIMIT / 2);
+        pthread_mutex_unlock(&shared_locks[size_class]);
+    }
+
+    buffer->data = NULL;
+    buffer->size = 0;
+}
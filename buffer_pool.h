@@ -0,0 +1,39 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+// Buffers come in power-of-two size classes from 1 KB to 256 KB
+#define BUFFER_POOL_MIN_SIZE 1024
+#define BUFFER_POOL_MAX_SIZE (256 * 1024)
+
+typedef struct {
+    char* data;
+    size_t size;
+    int size_class;
+} pool_buffer_t;
+
+/**
+ * Borrow a buffer from the pool
+ * @param buffer Filled with the borrowed buffer
+ * @param min_size Minimum size needed in bytes
+ * @return 0 on success, non-zero if min_size is too large or out of memory
+ */
+int buffer_pool_acquire(pool_buffer_t* buffer, size_t min_size);
+
+/**
+ * Move a borrowed buffer to a larger size class, keeping its contents
+ * @param buffer The borrowed buffer, updated in place
+ * @param used Number of bytes at the start of the buffer to keep
+ * @param min_size Minimum size needed in bytes
+ * @return 0 on success, non-zero on error (the old buffer is kept)
+ */
+int buffer_pool_grow(pool_buffer_t* buffer, size_t used, size_t min_size);
+
+/**
+ * Return a buffer to the pool. Does nothing if no buffer is held.
+ * @param buffer The borrowed buffer, cleared on return
+ */
+void buffer_pool_release(pool_buffer_t* buffer);
+
+#endif /* BUFFER_POOL_H */
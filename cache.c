@@ -0,0 +1,424 @@
+#define _GNU_SOURCE
+#include "cache.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "coroutine.h"
+#include "server.h"
+
+#define NUM_SHARDS 16
+#define SHARD_BUCKETS 256
+
+#define ENTRY_PENDING 0  // The handler is running for this key
+#define ENTRY_READY 1
+
+#define COALESCE_POLL_MS 1  // How often waiting coroutines check an entry
+
+// The path and the request's Accept-Encoding, separated by a newline
+#define MAX_KEY_LENGTH (MAX_PATH_LENGTH + MAX_HEADER_VALUE_LENGTH)
+
+// A cached response. The headers added by init_response() (Server, Date,
+// Connection) are not stored; a hit gets fresh ones.
+typedef struct cache_entry {
+    uint64_t hash;
+    char* key;
+    int state;
+    uint64_t expires_ms;
+    size_t size;  // Bytes charged against the shard limit
+
+    int status_code;
+    const char* status_text;  // Handlers only use string literals
+    const char* content_type;
+    char** header_names;
+    char** header_values;
+    int num_headers;
+    char* content;
+    size_t content_length;
+
+    struct cache_entry* next;  // Hash chain
+    struct cache_entry* lru_prev;
+    struct cache_entry* lru_next;
+} cache_entry_t;
+
+// Each shard has its own lock, so requests for different paths rarely
+// contend. Ready entries are kept in LRU order, most recent first.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    cache_entry_t* buckets[SHARD_BUCKETS];
+    cache_entry_t lru;  // Sentinel
+    size_t bytes;
+    unsigned long entries;
+} shard_t;
+
+typedef struct {
+    char prefix[64];
+    size_t prefix_length;
+    int ttl_ms;
+} route_t;
+
+static shard_t shards[NUM_SHARDS];
+static size_t shard_limit = 0;
+static route_t routes[MAX_CACHED_ROUTES];
+static int num_routes = 0;
+
+static atomic_ulong hits;
+static atomic_ulong misses;
+static atomic_ulong coalesced;
+static atomic_ulong evictions;
+static atomic_ulong bypassed;
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// FNV-1a
+static uint64_t hash_key(const char* key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char* c = (const unsigned char*)key; *c; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int parse_route(const char* spec, route_t* route) {
+    const char* equals = strrchr(spec, '=');
+    char* end;
+    long ttl = equals ? strtol(equals + 1, &end, 10) : 0;
+    if (!equals || equals == spec || *end != '\0' || ttl <= 0 ||
+        (size_t)(equals - spec) >= sizeof(route->prefix)) {
+        fprintf(stderr, "Invalid cached route %s, expected prefix=ttl_ms\n",
+                spec);
+        return 1;
+    }
+
+    route->prefix_length = equals - spec;
+    memcpy(route->prefix, spec, route->prefix_length);
+    route->prefix[route->prefix_length] = '\0';
+    route->ttl_ms                       = ttl;
+    return 0;
+}
+
+int cache_init(const char* const* specs, int count, size_t max_size) {
+    for (int i = 0; i < count; i++)
+        if (parse_route(specs[i], &routes[i]))
+            return 1;
+    num_routes  = count;
+    shard_limit = max_size / NUM_SHARDS;
+
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_cond_init(&shards[i].ready, NULL);
+        shards[i].lru.lru_prev = &shards[i].lru;
+        shards[i].lru.lru_next = &shards[i].lru;
+    }
+    return 0;
+}
+
+int cache_route_ttl(const char* path) {
+    for (int i = 0; i < num_routes; i++)
+        if (strncmp(path, routes[i].prefix, routes[i].prefix_length) == 0)
+            return routes[i].ttl_ms;
+    return 0;
+}
+
+static void lru_remove(cache_entry_t* entry) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void lru_push_front(shard_t* shard, cache_entry_t* entry) {
+    entry->lru_prev               = &shard->lru;
+    entry->lru_next               = shard->lru.lru_next;
+    shard->lru.lru_next->lru_prev = entry;
+    shard->lru.lru_next           = entry;
+}
+
+static cache_entry_t** find_slot(shard_t* shard, uint64_t hash,
+                                 const char* key) {
+    cache_entry_t** slot = &shard->buckets[hash % SHARD_BUCKETS];
+    while (*slot && ((*slot)->hash != hash || strcmp((*slot)->key, key)))
+        slot = &(*slot)->next;
+    return slot;
+}
+
+// Drop the stored response of an entry, keeping the entry itself
+static void clear_payload(shard_t* shard, cache_entry_t* entry) {
+    for (int i = 0; i < entry->num_headers; i++) {
+        free(entry->header_names[i]);
+        free(entry->header_values[i]);
+    }
+    free(entry->header_names);
+    free(entry->header_values);
+    free(entry->content);
+
+    entry->header_names  = NULL;
+    entry->header_values = NULL;
+    entry->num_headers   = 0;
+    entry->content       = NULL;
+    shard->bytes        -= entry->size;
+    entry->size          = 0;
+}
+
+static void remove_entry(shard_t* shard, cache_entry_t* entry) {
+    cache_entry_t** slot = find_slot(shard, entry->hash, entry->key);
+    *slot                = entry->next;
+    if (entry->state == ENTRY_READY)
+        lru_remove(entry);
+    clear_payload(shard, entry);
+    shard->entries--;
+    free(entry->key);
+    free(entry);
+}
+
+static int is_generated_header(const char* name) {
+    return strcasecmp(name, "Server") == 0 || strcasecmp(name, "Date") == 0 ||
+           strcasecmp(name, "Connection") == 0;
+}
+
+// Requests carrying credentials may get a response meant only for that
+// client, and conditional or range requests a partial one (304, 206), so
+// neither is answered from or stored in the cache
+static int bypasses_cache(const http_request_t* request) {
+    static const char* const headers[] = {
+        "Authorization",     "Cookie",   "If-None-Match",
+        "If-Match",          "If-Range", "If-Modified-Since",
+        "If-Unmodified-Since", "Range"};
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++)
+        if (get_header_value(request, headers[i]))
+            return 1;
+    return 0;
+}
+
+// Check a Cache-Control value for directives that forbid a shared cache
+// from storing the response or from serving it without revalidation
+static int forbids_caching(const char* value) {
+    while (*value) {
+        value += strspn(value, " \t,");
+        size_t length = strcspn(value, ",");
+        size_t name   = strcspn(value, "=, \t");
+        if (name > length)
+            name = length;
+
+        if ((name == 7 && strncasecmp(value, "private", 7) == 0) ||
+            (name == 8 && strncasecmp(value, "no-store", 8) == 0) ||
+            (name == 8 && strncasecmp(value, "no-cache", 8) == 0))
+            return 1;
+        if ((name == 7 && strncasecmp(value, "max-age", 7) == 0) ||
+            (name == 8 && strncasecmp(value, "s-maxage", 8) == 0)) {
+            const char* seconds = value + name;
+            seconds += strspn(seconds, " \t");
+            if (*seconds == '=') {
+                seconds++;
+                seconds += strspn(seconds, " \t\"");
+                if (atol(seconds) <= 0)
+                    return 1;
+            }
+        }
+        value += length;
+    }
+    return 0;
+}
+
+// Only complete 200 responses that are the same for every client and that
+// Cache-Control lets a shared cache reuse are stored. The key already
+// covers Accept-Encoding, so a response may vary on that but nothing else.
+// Responses sent from a file are already cheap.
+static int is_cacheable(const http_response_t* response) {
+    if (response->status_code != 200 || response->file_fd >= 0)
+        return 0;
+    for (int i = 0; i < response->num_headers; i++) {
+        const char* name = response->header_names[i];
+        if (strcasecmp(name, "Set-Cookie") == 0)
+            return 0;
+        if (strcasecmp(name, "Cache-Control") == 0 &&
+            forbids_caching(response->header_values[i]))
+            return 0;
+        if (strcasecmp(name, "Vary") == 0 &&
+            strcasecmp(response->header_values[i], "Accept-Encoding") != 0)
+            return 0;
+    }
+    return 1;
+}
+
+// Build the cache key for a request
+static void make_key(const http_request_t* request, char* key) {
+    const char* encoding = get_header_value(request, "Accept-Encoding");
+    snprintf(key, MAX_KEY_LENGTH, "%s\n%s", request->path,
+             encoding ? encoding : "");
+}
+
+// Copy a response into an entry. Returns 0 on success, -1 if the response
+// cannot be cached.
+static int store_response(shard_t* shard, cache_entry_t* entry,
+                          const http_response_t* response) {
+    if (!is_cacheable(response))
+        return -1;
+
+    size_t size = sizeof(cache_entry_t) + strlen(entry->key) + 1 +
+                  response->content_length;
+    for (int i = 0; i < response->num_headers; i++)
+        size += strlen(response->header_names[i]) +
+                strlen(response->header_values[i]) + 2;
+    if (size > shard_limit / 4)
+        return -1;
+
+    entry->header_names  = calloc(response->num_headers + 1, sizeof(char*));
+    entry->header_values = calloc(response->num_headers + 1, sizeof(char*));
+    entry->content       = response->content_length
+                               ? malloc(response->content_length)
+                               : NULL;
+    if (!entry->header_names || !entry->header_values ||
+        (response->content_length && !entry->content))
+        goto fail;
+
+    for (int i = 0; i < response->num_headers; i++) {
+        if (is_generated_header(response->header_names[i]))
+            continue;
+        int n                   = entry->num_headers;
+        entry->header_names[n]  = strdup(response->header_names[i]);
+        entry->header_values[n] = strdup(response->header_values[i]);
+        entry->num_headers++;
+        if (!entry->header_names[n] || !entry->header_values[n])
+            goto fail;
+    }
+
+    if (response->content_length)
+        memcpy(entry->content, response->content, response->content_length);
+    entry->content_length = response->content_length;
+    entry->status_code    = response->status_code;
+    entry->status_text    = response->status_text;
+    entry->content_type   = response->content_type;
+    entry->size           = size;
+    shard->bytes         += size;
+    return 0;
+
+fail:
+    clear_payload(shard, entry);
+    return -1;
+}
+
+static void load_response(const cache_entry_t* entry,
+                          http_response_t* response) {
+    set_response_status(response, entry->status_code, entry->status_text);
+    set_response_content_type(response, entry->content_type);
+    for (int i = 0; i < entry->num_headers; i++)
+        append_response_header(response, entry->header_names[i],
+                               entry->header_values[i]);
+    set_response_content(response, entry->content, entry->content_length);
+}
+
+// Evict least recently used entries until the shard fits its limit
+static void evict(shard_t* shard) {
+    while (shard->bytes > shard_limit && shard->lru.lru_prev != &shard->lru) {
+        remove_entry(shard, shard->lru.lru_prev);
+        atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+    }
+}
+
+void cache_serve(const http_request_t* request, http_response_t* response,
+                 int ttl_ms, cache_handler_t handler) {
+    if (bypasses_cache(request)) {
+        atomic_fetch_add_explicit(&bypassed, 1, memory_order_relaxed);
+        handler(request, response);
+        return;
+    }
+
+    char key[MAX_KEY_LENGTH];
+    make_key(request, key);
+    uint64_t hash  = hash_key(key);
+    shard_t* shard = &shards[(hash >> 56) % NUM_SHARDS];
+    int waited     = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    cache_entry_t* entry;
+    for (;;) {
+        entry = *find_slot(shard, hash, key);
+        if (!entry || entry->state != ENTRY_PENDING)
+            break;
+
+        // Another request is already running the handler for this key.
+        // A coroutine cannot block its worker on the condition variable,
+        // the handler it waits for may be suspended on the same worker.
+        waited = 1;
+        if (coroutine_active()) {
+            pthread_mutex_unlock(&shard->lock);
+            co_sleep_ms(COALESCE_POLL_MS);
+            pthread_mutex_lock(&shard->lock);
+        } else {
+            pthread_cond_wait(&shard->ready, &shard->lock);
+        }
+    }
+
+    if (entry && now_ms() < entry->expires_ms) {
+        lru_remove(entry);
+        lru_push_front(shard, entry);
+        load_response(entry, response);
+        pthread_mutex_unlock(&shard->lock);
+
+        atomic_fetch_add_explicit(waited ? &coalesced : &hits, 1,
+                                  memory_order_relaxed);
+        return;
+    }
+
+    // Miss: claim the key so concurrent requests wait for this one
+    if (entry) {
+        lru_remove(entry);
+        clear_payload(shard, entry);
+    } else {
+        entry = calloc(1, sizeof(cache_entry_t));
+        if (!entry || !(entry->key = strdup(key))) {
+            free(entry);
+            pthread_mutex_unlock(&shard->lock);
+            handler(request, response);
+            return;
+        }
+        entry->hash = hash;
+        entry->next = shard->buckets[hash % SHARD_BUCKETS];
+        shard->buckets[hash % SHARD_BUCKETS] = entry;
+        shard->entries++;
+    }
+    entry->state = ENTRY_PENDING;
+    pthread_mutex_unlock(&shard->lock);
+
+    atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+    handler(request, response);
+
+    pthread_mutex_lock(&shard->lock);
+    if (store_response(shard, entry, response) == 0) {
+        entry->state      = ENTRY_READY;
+        entry->expires_ms = now_ms() + ttl_ms;
+        lru_push_front(shard, entry);
+        evict(shard);
+    } else {
+        remove_entry(shard, entry);
+    }
+    pthread_cond_broadcast(&shard->ready);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_get_stats(cache_stats_t* stats) {
+    memset(stats, 0, sizeof(cache_stats_t));
+    stats->hits      = atomic_load(&hits);
+    stats->misses    = atomic_load(&misses);
+    stats->coalesced = atomic_load(&coalesced);
+    stats->evictions = atomic_load(&evictions);
+    stats->bypassed  = atomic_load(&bypassed);
+
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        stats->entries += shards[i].entries;
+        stats->bytes   += shards[i].bytes;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
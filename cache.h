@@ -0,0 +1,60 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+#include "request.h"
+#include "response.h"
+
+#define CACHE_DEFAULT_SIZE (16 * 1024 * 1024)
+
+typedef void (*cache_handler_t)(const http_request_t* request,
+                                http_response_t* response);
+
+typedef struct {
+    unsigned long hits;       // Answered from the cache
+    unsigned long misses;     // Ran the handler
+    unsigned long coalesced;  // Waited for another request's miss
+    unsigned long evictions;  // Removed to stay under the size limit
+    unsigned long bypassed;   // Not cacheable because of request headers
+    unsigned long entries;
+    unsigned long bytes;
+} cache_stats_t;
+
+/**
+ * Set up the response cache
+ * @param routes Cached path prefixes with their TTL, as "prefix=ttl_ms"
+ * @param count Number of routes
+ * @param max_size Memory the cache may use in bytes
+ * @return 0 on success, non-zero on error
+ */
+int cache_init(const char* const* routes, int count, size_t max_size);
+
+/**
+ * Find how long responses for a path may be cached
+ * @param path Request path
+ * @return TTL in milliseconds, or 0 if the path is not cached
+ */
+int cache_route_ttl(const char* path);
+
+/**
+ * Answer a GET request from the cache, running the handler on a miss.
+ * Entries are keyed by path and Accept-Encoding. Concurrent misses on the
+ * same key run the handler once; the other requests wait for its response.
+ * Requests with credentials or conditional headers skip the cache, and only
+ * 200 responses without Set-Cookie are stored.
+ * @param request The HTTP request
+ * @param response The HTTP response to fill
+ * @param ttl_ms How long a new response stays fresh
+ * @param handler Handler producing the response on a miss
+ */
+void cache_serve(const http_request_t* request, http_response_t* response,
+                 int ttl_ms, cache_handler_t handler);
+
+/**
+ * Read the cache counters
+ * @param stats Structure to fill
+ */
+void cache_get_stats(cache_stats_t* stats);
+
+#endif /* CACHE_H */
@@ -0,0 +1,146 @@
+#include "connection.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "coroutine.h"
+#include "tls.h"
+
+#define FILE_CHUNK_SIZE 16384
+
+int send_all(int fd, const void* data, size_t length, int flags) {
+    const char* pos = data;
+    while (length > 0) {
+        ssize_t sent = co_send(fd, pos, length, flags);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos    += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+int send_file_all(int fd, int file_fd, off_t offset, size_t length) {
+    while (length > 0) {
+        ssize_t sent = sendfile(fd, file_fd, &offset, length);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            // Sockets served by coroutines are non-blocking
+            if (errno == EAGAIN && coroutine_active() &&
+                co_wait(fd, POLLOUT) == 0)
+                continue;
+            return -1;
+        }
+        if (sent == 0)
+            return -1;  // File shrank underneath us
+        length -= sent;
+    }
+    return 0;
+}
+
+int connection_is_local(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr*)&addr, &length) != 0)
+        return 0;
+
+    if (addr.ss_family == AF_UNIX)
+        return 1;
+    if (addr.ss_family == AF_INET) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*)&addr;
+        return (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)&addr;
+        const struct in6_addr* ip      = &in6->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(ip) ||
+               (IN6_IS_ADDR_V4MAPPED(ip) && ip->s6_addr[12] == 127);
+    }
+    return 0;
+}
+
+ssize_t connection_recv(connection_t* conn, void* buffer, size_t length) {
+    if (!conn->ssl) {
+        ssize_t bytes;
+        do {
+            bytes = co_recv(conn->fd, buffer, length, 0);
+        } while (bytes < 0 && errno == EINTR);
+        return bytes;
+    }
+
+    size_t bytes;
+    int result;
+    while ((result = SSL_read_ex(conn->ssl, buffer, length, &bytes)) != 1) {
+        if (SSL_get_error(conn->ssl, result) == SSL_ERROR_ZERO_RETURN)
+            return 0;
+        if (tls_wait(conn->ssl, result) != 0)
+            return -1;
+    }
+    return bytes;
+}
+
+int connection_send_all(connection_t* conn, const void* data, size_t length,
+                        int flags) {
+    if (!conn->ssl)
+        return send_all(conn->fd, data, length, flags);
+
+    const char* pos = data;
+    while (length > 0) {
+        size_t written;
+        int result = SSL_write_ex(conn->ssl, pos, length, &written);
+        if (result != 1) {
+            if (tls_wait(conn->ssl, result) != 0)
+                return -1;
+            continue;
+        }
+        pos    += written;
+        length -= written;
+    }
+    return 0;
+}
+
+int connection_send_file(connection_t* conn, int file_fd, off_t offset,
+                         size_t length) {
+    if (!conn->ssl)
+        return send_file_all(conn->fd, file_fd, offset, length);
+
+    // With kTLS the kernel encrypts records, so the file still never
+    // passes through user space
+    if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl))) {
+        while (length > 0) {
+            ossl_ssize_t sent =
+                SSL_sendfile(conn->ssl, file_fd, offset, length, 0);
+            if (sent <= 0) {
+                if (tls_wait(conn->ssl, (int)sent) != 0)
+                    return -1;
+                continue;
+            }
+            offset += sent;
+            length -= sent;
+        }
+        return 0;
+    }
+
+    char chunk[FILE_CHUNK_SIZE];
+    while (length > 0) {
+        size_t want = length < sizeof(chunk) ? length : sizeof(chunk);
+        ssize_t bytes = pread(file_fd, chunk, want, offset);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return -1;
+        if (connection_send_all(conn, chunk, bytes, 0) != 0)
+            return -1;
+        offset += bytes;
+        length -= bytes;
+    }
+    return 0;
+}
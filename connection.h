@@ -0,0 +1,78 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <openssl/ssl.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// A client connection, either plaintext or TLS
+typedef struct {
+    int fd;
+    SSL* ssl;  // NULL for plaintext connections
+} connection_t;
+
+/**
+ * Send a whole buffer on a socket, retrying on partial writes. Inside a
+ * coroutine only the coroutine waits for buffer space.
+ * @param fd Socket to write to
+ * @param data Data to send
+ * @param length Length of the data in bytes
+ * @param flags Flags passed to send()
+ * @return 0 on success, -1 on error
+ */
+int send_all(int fd, const void* data, size_t length, int flags);
+
+/**
+ * Send a region of a file on a socket with sendfile(). Inside a coroutine
+ * only the coroutine waits for buffer space, for at most the socket's
+ * SO_SNDTIMEO.
+ * @param fd Socket to write to
+ * @param file_fd File to read from
+ * @param offset Offset of the region within the file
+ * @param length Length of the region in bytes
+ * @return 0 on success, -1 on error
+ */
+int send_file_all(int fd, int file_fd, off_t offset, size_t length);
+
+/**
+ * Check whether the peer of a socket is on this machine: a Unix socket
+ * client or a loopback address
+ * @param fd Connected socket
+ * @return 1 if the peer is local, 0 otherwise
+ */
+int connection_is_local(int fd);
+
+/**
+ * Receive data from a connection
+ * @param conn The connection
+ * @param buffer Buffer to receive into
+ * @param length Size of the buffer
+ * @return Number of bytes received, 0 on close, or -1 on error
+ */
+ssize_t connection_recv(connection_t* conn, void* buffer, size_t length);
+
+/**
+ * Send a whole buffer on a connection
+ * @param conn The connection
+ * @param data Data to send
+ * @param length Length of the data in bytes
+ * @param flags Flags passed to send() on plaintext connections
+ * @return 0 on success, -1 on error
+ */
+int connection_send_all(connection_t* conn, const void* data, size_t length,
+                        int flags);
+
+/**
+ * Send a region of a file on a connection. Plaintext connections and TLS
+ * connections with kernel TLS offload use sendfile(); other TLS
+ * connections fall back to reading the file through user space.
+ * @param conn The connection
+ * @param file_fd File to read from
+ * @param offset Offset of the region within the file
+ * @param length Length of the region in bytes
+ * @return 0 on success, -1 on error
+ */
+int connection_send_file(connection_t* conn, int file_fd, off_t offset,
+                         size_t length);
+
+#endif /* CONNECTION_H */
@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+#include "coroutine.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define STACK_POOL_SIZE 256  // Stacks kept per worker for reuse
+#define MAX_EVENTS 256
+
+typedef struct worker worker_t;
+
+typedef struct coroutine {
+    ucontext_t context;
+    void* (*fn)(void*);
+    void* arg;
+    char* stack;  // Lowest usable address, just above the guard page
+    worker_t* worker;
+    struct coroutine* next;  // Incoming or ready queue
+    int done;
+
+    int wait_fd;           // Descriptor waited on, -1 if none
+    int revents;           // poll() events that woke it, 0 on timeout
+    uint64_t deadline_ms;  // Valid while timer_index >= 0
+    int timer_index;       // Position in the timer heap, -1 if none
+
+    void* locals[COROUTINE_MAX_LOCALS];
+} coroutine_t;
+
+struct worker {
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;  // eventfd signalled when coroutines are spawned
+
+    pthread_mutex_t lock;
+    coroutine_t* incoming;  // Spawned by other threads, guarded by lock
+
+    ucontext_t scheduler;
+    coroutine_t* ready_head;
+    coroutine_t* ready_tail;
+
+    coroutine_t** timers;  // Min-heap on deadline_ms
+    int num_timers;
+    int timer_capacity;
+
+    char* stacks[STACK_POOL_SIZE];
+    int num_stacks;
+};
+
+static worker_t* workers   = NULL;
+static int num_workers     = 0;
+static atomic_uint next_worker;
+static atomic_int next_key = 0;
+static size_t page_size    = 0;
+
+static __thread coroutine_t* current = NULL;
+static __thread void* thread_locals[COROUTINE_MAX_LOCALS];
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Stacks grow down, so an overflow runs into the guard page below the
+// stack and faults instead of corrupting memory. Pages are only backed
+// once touched, so a coroutine costs what its handler actually uses.
+static char* allocate_stack(worker_t* worker) {
+    if (worker->num_stacks > 0)
+        return worker->stacks[--worker->num_stacks];
+
+    char* base = mmap(NULL, page_size + COROUTINE_STACK_SIZE,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                      -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base, page_size, PROT_NONE) != 0) {
+        munmap(base, page_size + COROUTINE_STACK_SIZE);
+        return NULL;
+    }
+    return base + page_size;
+}
+
+// A pooled stack keeps its address range but gives its pages back, so a
+// connection that once went deep does not pin that memory. MADV_FREE lets
+// the kernel take them only under memory pressure; older kernels lack it.
+static void release_stack(worker_t* worker, char* stack) {
+    if (worker->num_stacks < STACK_POOL_SIZE) {
+        if (madvise(stack, COROUTINE_STACK_SIZE, MADV_FREE) != 0)
+            madvise(stack, COROUTINE_STACK_SIZE, MADV_DONTNEED);
+        worker->stacks[worker->num_stacks++] = stack;
+    } else {
+        munmap(stack - page_size, page_size + COROUTINE_STACK_SIZE);
+    }
+}
+
+static void timer_swap(worker_t* worker, int a, int b) {
+    coroutine_t* co                = worker->timers[a];
+    worker->timers[a]              = worker->timers[b];
+    worker->timers[b]              = co;
+    worker->timers[a]->timer_index = a;
+    worker->timers[b]->timer_index = b;
+}
+
+static void timer_sift_up(worker_t* worker, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (worker->timers[parent]->deadline_ms <=
+            worker->timers[i]->deadline_ms)
+            break;
+        timer_swap(worker, i, parent);
+        i = parent;
+    }
+}
+
+static void timer_sift_down(worker_t* worker, int i) {
+    for (;;) {
+        int smallest = i;
+        int left     = 2 * i + 1;
+        int right    = left + 1;
+        if (left < worker->num_timers &&
+            worker->timers[left]->deadline_ms <
+                worker->timers[smallest]->deadline_ms)
+            smallest = left;
+        if (right < worker->num_timers &&
+            worker->timers[right]->deadline_ms <
+                worker->timers[smallest]->deadline_ms)
+            smallest = right;
+        if (smallest == i)
+            return;
+        timer_swap(worker, i, smallest);
+        i = smallest;
+    }
+}
+
+static int timer_add(worker_t* worker, coroutine_t* co, uint64_t deadline) {
+    if (worker->num_timers == worker->timer_capacity) {
+        int capacity = worker->timer_capacity ? worker->timer_capacity * 2 : 64;
+        coroutine_t** timers =
+            realloc(worker->timers, capacity * sizeof(coroutine_t*));
+        if (!timers)
+            return -1;
+        worker->timers         = timers;
+        worker->timer_capacity = capacity;
+    }
+
+    co->deadline_ms                      = deadline;
+    co->timer_index                      = worker->num_timers;
+    worker->timers[worker->num_timers++] = co;
+    timer_sift_up(worker, co->timer_index);
+    return 0;
+}
+
+static void timer_remove(worker_t* worker, coroutine_t* co) {
+    int i = co->timer_index;
+    if (i < 0)
+        return;
+    co->timer_index = -1;
+
+    int last = --worker->num_timers;
+    if (i == last)
+        return;
+    worker->timers[i]              = worker->timers[last];
+    worker->timers[i]->timer_index = i;
+    timer_sift_up(worker, i);
+    timer_sift_down(worker, worker->timers[i]->timer_index);
+}
+
+static void make_ready(worker_t* worker, coroutine_t* co) {
+    co->next = NULL;
+    if (worker->ready_tail)
+        worker->ready_tail->next = co;
+    else
+        worker->ready_head = co;
+    worker->ready_tail = co;
+}
+
+// Switch back to the scheduler until something makes the coroutine ready
+static void suspend(void) {
+    coroutine_t* co = current;
+    swapcontext(&co->context, &co->worker->scheduler);
+}
+
+// Wait for poll() events on a descriptor. Returns the events that
+// occurred, 0 on timeout or -1 on error.
+static int wait_fd(int fd, int events, int timeout_ms) {
+    coroutine_t* co  = current;
+    worker_t* worker = co->worker;
+
+    // poll() and epoll share the values of the basic events. A descriptor
+    // keeps its (disarmed) registration after a wakeup, so it is usually
+    // re-armed with a single MOD.
+    struct epoll_event event = {(uint32_t)events | EPOLLONESHOT, {.ptr = co}};
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, fd, &event) != 0 &&
+        (errno != ENOENT ||
+         epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)) {
+        // Regular files cannot be polled and are always ready
+        return errno == EPERM ? events : -1;
+    }
+
+    if (timeout_ms >= 0 && timer_add(worker, co, now_ms() + timeout_ms)) {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        return -1;
+    }
+
+    co->wait_fd = fd;
+    co->revents = 0;
+    suspend();
+    return co->revents;
+}
+
+static void coroutine_main(void) {
+    coroutine_t* co = current;
+    co->fn(co->arg);
+    co->done = 1;
+    // Returning resumes uc_link, the scheduler
+}
+
+static void start_coroutine(worker_t* worker, coroutine_t* co) {
+    co->worker      = worker;
+    co->wait_fd     = -1;
+    co->timer_index = -1;
+    co->stack       = allocate_stack(worker);
+
+    if (!co->stack || getcontext(&co->context) != 0) {
+        fprintf(stderr, "Warning: no coroutine stack, running on the worker\n");
+        if (co->stack)
+            release_stack(worker, co->stack);
+        co->fn(co->arg);
+        free(co);
+        return;
+    }
+
+    co->context.uc_stack.ss_sp   = co->stack;
+    co->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+    co->context.uc_link          = &worker->scheduler;
+    makecontext(&co->context, coroutine_main, 0);
+    make_ready(worker, co);
+}
+
+static void resume(worker_t* worker, coroutine_t* co) {
+    current = co;
+    swapcontext(&worker->scheduler, &co->context);
+    current = NULL;
+
+    if (co->done) {
+        release_stack(worker, co->stack);
+        free(co);
+    }
+}
+
+// Wake coroutines whose sleep or wait has timed out
+static void expire_timers(worker_t* worker) {
+    uint64_t now = now_ms();
+    while (worker->num_timers > 0 && worker->timers[0]->deadline_ms <= now) {
+        coroutine_t* co = worker->timers[0];
+        timer_remove(worker, co);
+        if (co->wait_fd >= 0) {
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, co->wait_fd, NULL);
+            co->wait_fd = -1;
+        }
+        co->revents = 0;
+        make_ready(worker, co);
+    }
+}
+
+static int next_timeout(worker_t* worker) {
+    if (worker->num_timers == 0)
+        return -1;
+    uint64_t now      = now_ms();
+    uint64_t deadline = worker->timers[0]->deadline_ms;
+    return deadline > now ? (int)(deadline - now) : 0;
+}
+
+static void* worker_main(void* arg) {
+    worker_t* worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        pthread_mutex_lock(&worker->lock);
+        coroutine_t* incoming = worker->incoming;
+        worker->incoming      = NULL;
+        pthread_mutex_unlock(&worker->lock);
+
+        while (incoming) {
+            coroutine_t* next = incoming->next;
+            start_coroutine(worker, incoming);
+            incoming = next;
+        }
+
+        // Run what is ready now; coroutines readied meanwhile wait for the
+        // next round so they cannot starve the event loop
+        coroutine_t* ready = worker->ready_head;
+        worker->ready_head = worker->ready_tail = NULL;
+        while (ready) {
+            coroutine_t* next = ready->next;
+            resume(worker, ready);
+            ready = next;
+        }
+
+        int timeout = worker->ready_head ? 0 : next_timeout(worker);
+        int count   = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == worker) {
+                eventfd_t value;
+                eventfd_read(worker->wake_fd, &value);
+                continue;
+            }
+
+            coroutine_t* co = events[i].data.ptr;
+            timer_remove(worker, co);
+            co->wait_fd = -1;
+            co->revents = events[i].events & (POLLIN | POLLOUT | POLLERR |
+                                              POLLHUP | POLLPRI);
+            make_ready(worker, co);
+        }
+        expire_timers(worker);
+    }
+
+    return NULL;
+}
+
+int coroutine_init(int count) {
+    page_size = sysconf(_SC_PAGESIZE);
+    workers   = calloc(count, sizeof(worker_t));
+    if (!workers) {
+        perror("Failed to allocate coroutine workers");
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        worker_t* worker = &workers[i];
+        pthread_mutex_init(&worker->lock, NULL);
+
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->wake_fd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (worker->epoll_fd < 0 || worker->wake_fd < 0) {
+            perror("Failed to create coroutine event loop");
+            return 1;
+        }
+
+        struct epoll_event event = {EPOLLIN, {.ptr = worker}};
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd,
+                      &event) != 0) {
+            perror("Failed to create coroutine event loop");
+            return 1;
+        }
+
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            perror("Failed to create coroutine worker");
+            return 1;
+        }
+        num_workers++;
+    }
+
+    return 0;
+}
+
+int coroutine_spawn(void* (*fn)(void*), void* arg) {
+    if (num_workers == 0)
+        return -1;
+
+    coroutine_t* co = calloc(1, sizeof(coroutine_t));
+    if (!co)
+        return -1;
+    co->fn  = fn;
+    co->arg = arg;
+
+    unsigned index =
+        atomic_fetch_add_explicit(&next_worker, 1, memory_order_relaxed);
+    worker_t* worker = &workers[index % num_workers];
+
+    pthread_mutex_lock(&worker->lock);
+    co->next         = worker->incoming;
+    worker->incoming = co;
+    pthread_mutex_unlock(&worker->lock);
+
+    eventfd_write(worker->wake_fd, 1);
+    return 0;
+}
+
+int coroutine_active(void) { return current != NULL; }
+
+typedef struct {
+    void (*fn)(void*);
+    void* arg;
+    int done_fd;
+} offload_t;
+
+static void* offload_main(void* arg) {
+    offload_t* offload = arg;
+    int done_fd        = offload->done_fd;
+
+    offload->fn(offload->arg);
+    // The offload_t lives on the waiting coroutine's stack and may be gone
+    // once this is written
+    eventfd_write(done_fd, 1);
+    return NULL;
+}
+
+void coroutine_offload(void (*fn)(void*), void* arg) {
+    if (!current) {
+        fn(arg);
+        return;
+    }
+
+    offload_t offload = {fn, arg, eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)};
+    pthread_t thread;
+    if (offload.done_fd < 0 ||
+        pthread_create(&thread, NULL, offload_main, &offload) != 0) {
+        // Better to stall this worker than to drop the work
+        if (offload.done_fd >= 0)
+            close(offload.done_fd);
+        fn(arg);
+        return;
+    }
+    pthread_detach(thread);
+
+    struct pollfd pfd = {offload.done_fd, POLLIN, 0};
+    while (co_poll(&pfd, -1) <= 0)
+        ;
+    close(offload.done_fd);
+}
+
+int coroutine_key_create(void) {
+    int key = atomic_fetch_add(&next_key, 1);
+    return key < COROUTINE_MAX_LOCALS ? key : -1;
+}
+
+void* coroutine_get_local(int key) {
+    if (key < 0 || key >= COROUTINE_MAX_LOCALS)
+        return NULL;
+    return current ? current->locals[key] : thread_locals[key];
+}
+
+int coroutine_set_local(int key, void* value) {
+    if (key < 0 || key >= COROUTINE_MAX_LOCALS)
+        return -1;
+    if (current)
+        current->locals[key] = value;
+    else
+        thread_locals[key] = value;
+    return 0;
+}
+
+// The SO_RCVTIMEO or SO_SNDTIMEO of a socket in milliseconds, -1 if none
+static int socket_timeout_ms(int fd, int option) {
+    struct timeval timeout;
+    socklen_t length = sizeof(timeout);
+    if (getsockopt(fd, SOL_SOCKET, option, &timeout, &length) != 0 ||
+        (timeout.tv_sec == 0 && timeout.tv_usec == 0))
+        return -1;
+    return timeout.tv_sec * 1000 + timeout.tv_usec / 1000;
+}
+
+int co_wait(int fd, short events) {
+    int timeout_ms = socket_timeout_ms(
+        fd, (events & POLLOUT) ? SO_SNDTIMEO : SO_RCVTIMEO);
+
+    int ready;
+    if (current) {
+        ready = wait_fd(fd, events, timeout_ms);
+    } else {
+        struct pollfd pfd = {fd, events, 0};
+        ready = poll(&pfd, 1, timeout_ms);
+    }
+
+    if (ready == 0)
+        errno = EAGAIN;
+    return ready > 0 ? 0 : -1;
+}
+
+ssize_t co_recv(int fd, void* buffer, size_t length, int flags) {
+    if (!current)
+        return recv(fd, buffer, length, flags);
+
+    for (;;) {
+        ssize_t bytes = recv(fd, buffer, length, flags | MSG_DONTWAIT);
+        if (bytes >= 0 || (flags & MSG_DONTWAIT) ||
+            (errno != EAGAIN && errno != EWOULDBLOCK))
+            return bytes;
+        if (co_wait(fd, POLLIN) != 0)
+            return -1;
+    }
+}
+
+ssize_t co_send(int fd, const void* data, size_t length, int flags) {
+    if (!current)
+        return send(fd, data, length, flags);
+
+    for (;;) {
+        ssize_t sent = send(fd, data, length, flags | MSG_DONTWAIT);
+        if (sent >= 0 || (flags & MSG_DONTWAIT) ||
+            (errno != EAGAIN && errno != EWOULDBLOCK))
+            return sent;
+        if (co_wait(fd, POLLOUT) != 0)
+            return -1;
+    }
+}
+
+int co_poll(struct pollfd* pfd, int timeout_ms) {
+    if (!current)
+        return poll(pfd, 1, timeout_ms);
+
+    // Already ready is the common case and needs no switch
+    int ready = poll(pfd, 1, 0);
+    if (ready != 0 || timeout_ms == 0)
+        return ready;
+
+    int events = wait_fd(pfd->fd, pfd->events, timeout_ms);
+    if (events < 0)
+        return -1;
+    pfd->revents = events;
+    return events != 0;
+}
+
+void co_sleep_ms(int ms) {
+    if (!current) {
+        struct timespec delay = {ms / 1000, (long)(ms % 1000) * 1000000};
+        nanosleep(&delay, NULL);
+        return;
+    }
+
+    if (timer_add(current->worker, current, now_ms() + ms) == 0)
+        suspend();
+}
+
+unsigned int co_sleep(unsigned int seconds) {
+    if (!current)
+        return sleep(seconds);
+
+    co_sleep_ms(seconds * 1000);
+    return 0;
+}
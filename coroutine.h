@@ -0,0 +1,114 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <poll.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define COROUTINE_STACK_SIZE (256 * 1024)
+#define COROUTINE_MAX_LOCALS 8
+
+/**
+ * Start the worker threads. Each runs its own event loop and scheduler, and
+ * serves any number of coroutines.
+ * @param num_workers Number of worker threads
+ * @return 0 on success, 1 on error
+ */
+int coroutine_init(int num_workers);
+
+/**
+ * Run a function in a new coroutine on one of the workers. Safe to call
+ * from any thread.
+ * @param fn Function to run, with the same signature as a thread function
+ * @param arg Argument passed to fn
+ * @return 0 on success, -1 on error
+ */
+int coroutine_spawn(void* (*fn)(void*), void* arg);
+
+/**
+ * Check whether the caller is running in a coroutine
+ * @return Non-zero inside a coroutine, 0 on an ordinary thread
+ */
+int coroutine_active(void);
+
+/**
+ * Run a function that blocks in ways the scheduler cannot see on a
+ * separate thread, suspending only the calling coroutine until it returns.
+ * Outside a coroutine the function is called directly.
+ * @param fn Function to run
+ * @param arg Argument passed to fn
+ */
+void coroutine_offload(void (*fn)(void*), void* arg);
+
+/**
+ * Allocate a key for fiber-local storage
+ * @return The key, or -1 if all COROUTINE_MAX_LOCALS keys are taken
+ */
+int coroutine_key_create(void);
+
+/**
+ * Get the value stored under a key for the current coroutine (or thread,
+ * outside a coroutine)
+ * @param key Key from coroutine_key_create()
+ * @return The value, NULL if none was set or the key is invalid
+ */
+void* coroutine_get_local(int key);
+
+/**
+ * Set the value stored under a key for the current coroutine (or thread,
+ * outside a coroutine)
+ * @param key Key from coroutine_key_create()
+ * @param value Value to store
+ * @return 0 on success, -1 if the key is invalid
+ */
+int coroutine_set_local(int key, void* value);
+
+/**
+ * Wait until a socket is readable (POLLIN) or writable (POLLOUT),
+ * suspending the coroutine instead of the thread. Waits at most the
+ * socket's SO_RCVTIMEO or SO_SNDTIMEO respectively, forever if unset.
+ * @param fd The socket
+ * @param events POLLIN or POLLOUT
+ * @return 0 when ready, -1 on error or timeout (errno EAGAIN)
+ */
+int co_wait(int fd, short events);
+
+/**
+ * recv() that suspends the coroutine instead of the thread while no data
+ * is available. The socket's SO_RCVTIMEO, if any, still applies.
+ * @return As recv()
+ */
+ssize_t co_recv(int fd, void* buffer, size_t length, int flags);
+
+/**
+ * send() that suspends the coroutine instead of the thread while the
+ * socket buffer is full, unless flags include MSG_DONTWAIT. The socket's
+ * SO_SNDTIMEO, if any, still applies.
+ * @return As send()
+ */
+ssize_t co_send(int fd, const void* data, size_t length, int flags);
+
+/**
+ * poll() on a single descriptor that suspends the coroutine instead of the
+ * thread
+ * @param pfd The descriptor and events to wait for
+ * @param timeout_ms Timeout in milliseconds, -1 to wait forever
+ * @return As poll()
+ */
+int co_poll(struct pollfd* pfd, int timeout_ms);
+
+/**
+ * sleep() that suspends the coroutine instead of the thread
+ * @param seconds Time to sleep
+ * @return 0
+ */
+unsigned int co_sleep(unsigned int seconds);
+
+/**
+ * Sleep for a number of milliseconds, suspending the coroutine instead of
+ * the thread
+ * @param ms Time to sleep
+ */
+void co_sleep_ms(int ms);
+
+#endif /* COROUTINE_H */
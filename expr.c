@@ -0,0 +1,531 @@
+#include "expr.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PARAMS 255  // Operands of OP_PARAM are one byte
+#define MAX_CODE 2048
+#define MAX_NESTING 64  // Parentheses, calls and unary operators
+#define MAX_ARGS 16
+#define CACHE_SLOTS 256  // Compiled programs kept (power of 2)
+
+// Bytecode. Operands follow their opcode as single bytes.
+enum {
+    OP_PARAM,  // idx: push params[idx]
+    OP_CONST,  // idx: push constants[idx]
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_POW,
+    OP_NEG,
+    OP_CALL,  // fn, argc: pop argc values, push fn(values)
+};
+
+typedef struct {
+    uint8_t code[MAX_CODE];
+    size_t code_length;
+    int num_params;
+    int max_depth;  // Stack slots the program needs
+} program_t;
+
+// An expression split into its shape, where every number is replaced by
+// '#', and the numbers themselves, which are bound to the program's
+// parameters in order
+typedef struct {
+    char shape[EXPR_MAX_LENGTH + 1];
+    double params[MAX_PARAMS];
+    int num_params;
+} split_expr_t;
+
+typedef struct {
+    const char* shape;
+    size_t position;
+    program_t* program;
+    int next_param;
+    int depth;
+    int nesting;
+    char* error;
+    size_t error_size;
+} compiler_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int used;
+    char shape[EXPR_MAX_LENGTH + 1];
+    program_t program;
+} cache_slot_t;
+
+typedef struct {
+    const char* name;
+    int min_args;
+    int max_args;  // 0 for any number
+} function_t;
+
+enum {
+    FN_SIN,
+    FN_COS,
+    FN_TAN,
+    FN_SQRT,
+    FN_ABS,
+    FN_LOG,
+    FN_EXP,
+    FN_POW,
+    FN_MIN,
+    FN_MAX,
+    NUM_FUNCTIONS
+};
+
+static const function_t functions[NUM_FUNCTIONS] = {
+    [FN_SIN] = {"sin", 1, 1},  [FN_COS] = {"cos", 1, 1},
+    [FN_TAN] = {"tan", 1, 1},  [FN_SQRT] = {"sqrt", 1, 1},
+    [FN_ABS] = {"abs", 1, 1},  [FN_LOG] = {"log", 1, 1},
+    [FN_EXP] = {"exp", 1, 1},  [FN_POW] = {"pow", 2, 2},
+    [FN_MIN] = {"min", 1, 0},  [FN_MAX] = {"max", 1, 0},
+};
+
+static const char* constant_names[] = {"pi", "e"};
+static const double constants[]     = {M_PI, M_E};
+
+static cache_slot_t cache[CACHE_SLOTS];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void init_cache(void) {
+    for (int i = 0; i < CACHE_SLOTS; i++)
+        pthread_mutex_init(&cache[i].lock, NULL);
+}
+
+static int set_error(char* error, size_t error_size, const char* format,
+                     ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(error, error_size, format, args);
+    va_end(args);
+    return -1;
+}
+
+// Length of the decimal literal at number: digits with an optional
+// fraction and exponent. Unlike strtod() this stops before "x" in "0x10",
+// so hexadecimal is not read as a number.
+static size_t decimal_length(const char* number) {
+    size_t length = strspn(number, "0123456789");
+    if (number[length] == '.')
+        length += 1 + strspn(number + length + 1, "0123456789");
+
+    if (number[length] == 'e' || number[length] == 'E') {
+        size_t sign   = number[length + 1] == '+' || number[length + 1] == '-';
+        size_t digits = strspn(number + length + 1 + sign, "0123456789");
+        if (digits > 0)
+            length += 1 + sign + digits;
+    }
+    return length;
+}
+
+// Split an expression into its shape and numbers, dropping whitespace. A
+// space is kept between names and numbers that would otherwise run
+// together.
+static int split_expression(const char* expression, split_expr_t* split,
+                            char* error, size_t error_size) {
+    size_t length     = 0;
+    split->num_params = 0;
+
+    for (const char* c = expression; *c;) {
+        if (isspace((unsigned char)*c)) {
+            c++;
+            continue;
+        }
+
+        int is_number = isdigit((unsigned char)*c) ||
+                        (*c == '.' && isdigit((unsigned char)c[1]));
+        int is_name   = isalpha((unsigned char)*c);
+        if (!is_number && !is_name && !strchr("+-*/%^(),", *c))
+            return set_error(error, error_size, "Unexpected character '%c'",
+                             *c);
+
+        if ((is_number || is_name) && length > 0 &&
+            (isalpha((unsigned char)split->shape[length - 1]) ||
+             split->shape[length - 1] == '#'))
+            split->shape[length++] = ' ';
+
+        if (length + 1 > EXPR_MAX_LENGTH)
+            return set_error(error, error_size, "Expression too long");
+
+        if (is_number) {
+            if (split->num_params == MAX_PARAMS)
+                return set_error(error, error_size,
+                                 "Too many numbers (at most %d)", MAX_PARAMS);
+            char literal[64];
+            size_t literal_length = decimal_length(c);
+            if (literal_length >= sizeof(literal))
+                return set_error(error, error_size, "Number too long");
+            memcpy(literal, c, literal_length);
+            literal[literal_length] = '\0';
+
+            split->params[split->num_params++] = strtod(literal, NULL);
+            split->shape[length++]             = '#';
+            c                                 += literal_length;
+        } else if (is_name) {
+            while (isalnum((unsigned char)*c) && length < EXPR_MAX_LENGTH)
+                split->shape[length++] = *c++;
+        } else {
+            split->shape[length++] = *c++;
+        }
+    }
+
+    split->shape[length] = '\0';
+    return 0;
+}
+
+static int compile_error(compiler_t* compiler, const char* message) {
+    return set_error(compiler->error, compiler->error_size,
+                     "%s at position %zu", message, compiler->position);
+}
+
+static char peek(compiler_t* compiler) {
+    while (compiler->shape[compiler->position] == ' ')
+        compiler->position++;
+    return compiler->shape[compiler->position];
+}
+
+// Emit an instruction and track how deep it leaves the stack
+static int emit(compiler_t* compiler, int depth_change, int length, ...) {
+    program_t* program = compiler->program;
+    if (program->code_length + length > MAX_CODE)
+        return compile_error(compiler, "Expression too complex");
+
+    va_list args;
+    va_start(args, length);
+    for (int i = 0; i < length; i++)
+        program->code[program->code_length++] = (uint8_t)va_arg(args, int);
+    va_end(args);
+
+    compiler->depth += depth_change;
+    if (compiler->depth > program->max_depth)
+        program->max_depth = compiler->depth;
+    return 0;
+}
+
+static int compile_sum(compiler_t* compiler);
+static int compile_unary(compiler_t* compiler);
+
+// name(args...) or a constant
+static int compile_name(compiler_t* compiler) {
+    const char* start = compiler->shape + compiler->position;
+    size_t length     = 0;
+    while (isalnum((unsigned char)start[length]))
+        length++;
+
+    for (size_t i = 0; i < sizeof(constants) / sizeof(constants[0]); i++) {
+        if (strlen(constant_names[i]) == length &&
+            strncmp(start, constant_names[i], length) == 0) {
+            compiler->position += length;
+            return emit(compiler, 1, 2, OP_CONST, (int)i);
+        }
+    }
+
+    int fn = 0;
+    while (fn < NUM_FUNCTIONS && (strlen(functions[fn].name) != length ||
+                                  strncmp(start, functions[fn].name, length)))
+        fn++;
+    if (fn == NUM_FUNCTIONS)
+        return compile_error(compiler, "Unknown name");
+
+    compiler->position += length;
+    if (peek(compiler) != '(')
+        return compile_error(compiler, "Expected '('");
+    compiler->position++;
+
+    int argc = 0;
+    if (peek(compiler) != ')') {
+        for (;;) {
+            if (argc == MAX_ARGS)
+                return compile_error(compiler, "Too many arguments");
+            if (compile_sum(compiler) != 0)
+                return -1;
+            argc++;
+            if (peek(compiler) != ',')
+                break;
+            compiler->position++;
+        }
+    }
+    if (peek(compiler) != ')')
+        return compile_error(compiler, "Expected ')'");
+    compiler->position++;
+
+    const function_t* function = &functions[fn];
+    if (argc < function->min_args ||
+        (function->max_args && argc > function->max_args))
+        return compile_error(compiler, "Wrong number of arguments");
+
+    return emit(compiler, 1 - argc, 3, OP_CALL, fn, argc);
+}
+
+static int compile_primary(compiler_t* compiler) {
+    char c = peek(compiler);
+
+    if (c == '#') {
+        // Numbers are compiled left to right, the order they were split in
+        compiler->position++;
+        return emit(compiler, 1, 2, OP_PARAM, compiler->next_param++);
+    }
+
+    if (isalpha((unsigned char)c)) {
+        if (++compiler->nesting > MAX_NESTING)
+            return compile_error(compiler, "Expression nested too deeply");
+        int result = compile_name(compiler);
+        compiler->nesting--;
+        return result;
+    }
+
+    if (c == '(') {
+        if (++compiler->nesting > MAX_NESTING)
+            return compile_error(compiler, "Expression nested too deeply");
+        compiler->position++;
+        if (compile_sum(compiler) != 0)
+            return -1;
+        if (peek(compiler) != ')')
+            return compile_error(compiler, "Expected ')'");
+        compiler->position++;
+        compiler->nesting--;
+        return 0;
+    }
+
+    return compile_error(compiler, c ? "Unexpected token" : "Unexpected end");
+}
+
+// Exponentiation is right associative and binds tighter than unary minus
+// on its left, so -2^2 is -4 and 2^-1 is 0.5
+static int compile_power(compiler_t* compiler) {
+    if (compile_primary(compiler) != 0)
+        return -1;
+    if (peek(compiler) != '^')
+        return 0;
+
+    compiler->position++;
+    if (++compiler->nesting > MAX_NESTING)
+        return compile_error(compiler, "Expression nested too deeply");
+    if (compile_unary(compiler) != 0)
+        return -1;
+    compiler->nesting--;
+    return emit(compiler, -1, 1, OP_POW);
+}
+
+static int compile_unary(compiler_t* compiler) {
+    char c = peek(compiler);
+    if (c != '-' && c != '+')
+        return compile_power(compiler);
+
+    compiler->position++;
+    if (++compiler->nesting > MAX_NESTING)
+        return compile_error(compiler, "Expression nested too deeply");
+    if (compile_unary(compiler) != 0)
+        return -1;
+    compiler->nesting--;
+    return c == '-' ? emit(compiler, 0, 1, OP_NEG) : 0;
+}
+
+static int compile_product(compiler_t* compiler) {
+    if (compile_unary(compiler) != 0)
+        return -1;
+
+    for (;;) {
+        char c = peek(compiler);
+        if (c != '*' && c != '/' && c != '%')
+            return 0;
+        compiler->position++;
+        if (compile_unary(compiler) != 0)
+            return -1;
+        int op = c == '*' ? OP_MUL : c == '/' ? OP_DIV : OP_MOD;
+        if (emit(compiler, -1, 1, op) != 0)
+            return -1;
+    }
+}
+
+static int compile_sum(compiler_t* compiler) {
+    if (compile_product(compiler) != 0)
+        return -1;
+
+    for (;;) {
+        char c = peek(compiler);
+        if (c != '+' && c != '-')
+            return 0;
+        compiler->position++;
+        if (compile_product(compiler) != 0)
+            return -1;
+        if (emit(compiler, -1, 1, c == '+' ? OP_ADD : OP_SUB) != 0)
+            return -1;
+    }
+}
+
+static int compile(const char* shape, int num_params, program_t* program,
+                   char* error, size_t error_size) {
+    program->code_length = 0;
+    program->num_params  = num_params;
+    program->max_depth   = 0;
+
+    compiler_t compiler = {shape, 0, program, 0, 0, 0, error, error_size};
+    if (!*shape)
+        return set_error(error, error_size, "Empty expression");
+    if (compile_sum(&compiler) != 0)
+        return -1;
+    if (peek(&compiler) != '\0')
+        return compile_error(&compiler, "Unexpected token");
+    return 0;
+}
+
+static double call_function(int fn, const double* args, int argc) {
+    switch (fn) {
+        case FN_SIN:
+            return sin(args[0]);
+        case FN_COS:
+            return cos(args[0]);
+        case FN_TAN:
+            return tan(args[0]);
+        case FN_SQRT:
+            return sqrt(args[0]);
+        case FN_ABS:
+            return fabs(args[0]);
+        case FN_LOG:
+            return log(args[0]);
+        case FN_EXP:
+            return exp(args[0]);
+        case FN_POW:
+            return pow(args[0], args[1]);
+        case FN_MIN:
+        case FN_MAX: {
+            double result = args[0];
+            for (int i = 1; i < argc; i++)
+                if (fn == FN_MIN ? args[i] < result : args[i] > result)
+                    result = args[i];
+            return result;
+        }
+    }
+    return NAN;
+}
+
+// Run a program. The compiler checked the stack depth and arities, so the
+// VM does not have to.
+static double run(const program_t* program, const double* params) {
+    double stack[program->max_depth > 0 ? program->max_depth : 1];
+    int top = 0;
+
+    for (size_t pc = 0; pc < program->code_length;) {
+        switch (program->code[pc++]) {
+            case OP_PARAM:
+                stack[top++] = params[program->code[pc++]];
+                break;
+            case OP_CONST:
+                stack[top++] = constants[program->code[pc++]];
+                break;
+            case OP_ADD:
+                top--;
+                stack[top - 1] += stack[top];
+                break;
+            case OP_SUB:
+                top--;
+                stack[top - 1] -= stack[top];
+                break;
+            case OP_MUL:
+                top--;
+                stack[top - 1] *= stack[top];
+                break;
+            case OP_DIV:
+                top--;
+                stack[top - 1] /= stack[top];
+                break;
+            case OP_MOD:
+                top--;
+                stack[top - 1] = fmod(stack[top - 1], stack[top]);
+                break;
+            case OP_POW:
+                top--;
+                stack[top - 1] = pow(stack[top - 1], stack[top]);
+                break;
+            case OP_NEG:
+                stack[top - 1] = -stack[top - 1];
+                break;
+            case OP_CALL: {
+                int fn      = program->code[pc++];
+                int argc    = program->code[pc++];
+                top        -= argc;
+                stack[top]  = call_function(fn, &stack[top], argc);
+                top++;
+                break;
+            }
+        }
+    }
+
+    return stack[0];
+}
+
+// FNV-1a
+static uint32_t hash_shape(const char* shape) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* c = (const unsigned char*)shape; *c; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// The cache is direct mapped: a shape has one slot and replaces whatever
+// was there. Programs are copied out under the slot lock, so a slot can be
+// overwritten while another thread runs its old program.
+static int lookup_program(const char* shape, program_t* program) {
+    cache_slot_t* slot = &cache[hash_shape(shape) & (CACHE_SLOTS - 1)];
+    int found          = 0;
+
+    pthread_mutex_lock(&slot->lock);
+    if (slot->used && strcmp(slot->shape, shape) == 0) {
+        memcpy(program->code, slot->program.code, slot->program.code_length);
+        program->code_length = slot->program.code_length;
+        program->num_params  = slot->program.num_params;
+        program->max_depth   = slot->program.max_depth;
+        found                = 1;
+    }
+    pthread_mutex_unlock(&slot->lock);
+
+    return found;
+}
+
+static void store_program(const char* shape, const program_t* program) {
+    cache_slot_t* slot = &cache[hash_shape(shape) & (CACHE_SLOTS - 1)];
+
+    pthread_mutex_lock(&slot->lock);
+    strcpy(slot->shape, shape);
+    memcpy(slot->program.code, program->code, program->code_length);
+    slot->program.code_length = program->code_length;
+    slot->program.num_params  = program->num_params;
+    slot->program.max_depth   = program->max_depth;
+    slot->used                = 1;
+    pthread_mutex_unlock(&slot->lock);
+}
+
+int expr_evaluate(const char* expression, double* result, char* error,
+                  size_t error_size) {
+    pthread_once(&cache_once, init_cache);
+
+    split_expr_t split;
+    if (split_expression(expression, &split, error, error_size) != 0)
+        return -1;
+
+    program_t program;
+    if (!lookup_program(split.shape, &program)) {
+        if (compile(split.shape, split.num_params, &program, error,
+                    error_size) != 0)
+            return -1;
+        store_program(split.shape, &program);
+    }
+
+    *result = run(&program, split.params);
+    if (!isfinite(*result))
+        return set_error(error, error_size, "Result is not a finite number");
+    return 0;
+}
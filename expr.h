@@ -0,0 +1,22 @@
+#ifndef EXPR_H
+#define EXPR_H
+
+#include <stddef.h>
+
+#define EXPR_MAX_LENGTH 1024
+
+/**
+ * Evaluate an arithmetic expression. Supports + - * / % ^, parentheses,
+ * unary minus, the constants pi and e, and the functions sin, cos, tan,
+ * sqrt, abs, log, exp, pow, min and max. Compiled programs are cached by
+ * the shape of the expression, so "1+2" and "3+4" share one program.
+ * @param expression Expression text
+ * @param result Where to store the value
+ * @param error Buffer for an error message
+ * @param error_size Size of the error buffer
+ * @return 0 on success, non-zero on error
+ */
+int expr_evaluate(const char* expression, double* result, char* error,
+                  size_t error_size);
+
+#endif /* EXPR_H */
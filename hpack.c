@@ -0,0 +1,566 @@
+#include "hpack.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRY_OVERHEAD 32
+#define HUFFMAN_SYMBOLS 257
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_BITS 30
+#define MAX_STRING_LENGTH 65536
+
+typedef struct {
+    const char* name;
+    const char* value;
+} static_entry_t;
+
+// RFC 7541 Appendix A
+static const static_entry_t static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define STATIC_TABLE_SIZE \
+    ((int)(sizeof(static_table) / sizeof(static_table[0])))
+
+// Code lengths of the RFC 7541 Appendix B Huffman code. The code is
+// canonical, so the codes themselves follow from the lengths.
+static const uint8_t huffman_lengths[HUFFMAN_SYMBOLS] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,  // 0
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,  // 16
+    6,  10, 10, 12, 13, 6,  8,  11, 10, 10, 8,  11, 8,  6,  6,  6,   // 32
+    5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8,  15, 6,  12, 10,  // 48
+    13, 6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,   // 64
+    7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8,  13, 19, 13, 14, 6,   // 80
+    15, 5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,   // 96
+    6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7,  15, 11, 14, 13, 28,  // 112
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,  // 128
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,  // 144
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,  // 160
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,  // 176
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,  // 192
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,  // 208
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,  // 224
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,  // 240
+    30,                                                              // EOS
+};
+
+// Canonical decoding tables: number of codes of each length, and the
+// symbols ordered by code
+static int huffman_counts[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_symbols[HUFFMAN_SYMBOLS];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void build_huffman_tables(void) {
+    for (int i = 0; i < HUFFMAN_SYMBOLS; i++)
+        huffman_counts[huffman_lengths[i]]++;
+
+    int offsets[HUFFMAN_MAX_BITS + 1];
+    offsets[0] = 0;
+    for (int len = 1; len <= HUFFMAN_MAX_BITS; len++)
+        offsets[len] = offsets[len - 1] + huffman_counts[len - 1];
+
+    for (int i = 0; i < HUFFMAN_SYMBOLS; i++)
+        huffman_symbols[offsets[huffman_lengths[i]]++] = i;
+}
+
+// Decode a Huffman-coded string into out, which must hold at least
+// length * 8 / 5 bytes. Returns the decoded length or -1 on error.
+static long huffman_decode(const uint8_t* data, size_t length, char* out) {
+    pthread_once(&huffman_once, build_huffman_tables);
+
+    long out_length = 0;
+    int code        = 0;  // Bits of the current code
+    int first       = 0;  // First code of the current length
+    int index       = 0;  // Index of the first symbol of the current length
+    int bits        = 0;  // Length of the current code
+    int all_ones    = 1;  // Whether every bit of the current code is 1
+
+    for (size_t i = 0; i < length; i++) {
+        for (int shift = 7; shift >= 0; shift--) {
+            int bit   = (data[i] >> shift) & 1;
+            code     |= bit;
+            all_ones &= bit;
+            bits++;
+
+            int count = huffman_counts[bits];
+            if (code - first < count) {
+                int symbol = huffman_symbols[index + code - first];
+                if (symbol == HUFFMAN_EOS)
+                    return -1;
+                out[out_length++] = (char)symbol;
+                code = first = index = bits = 0;
+                all_ones                    = 1;
+                continue;
+            }
+
+            if (bits == HUFFMAN_MAX_BITS)
+                return -1;
+
+            index  += count;
+            first  += count;
+            first <<= 1;
+            code  <<= 1;
+        }
+    }
+
+    // Leftover bits must be a prefix of EOS, i.e. at most 7 one bits
+    if (bits > 7 || !all_ones)
+        return -1;
+
+    return out_length;
+}
+
+void hpack_table_init(hpack_table_t* table, size_t max_size) {
+    if (!table)
+        return;
+
+    memset(table, 0, sizeof(hpack_table_t));
+    table->max_size = max_size;
+}
+
+void hpack_table_free(hpack_table_t* table) {
+    if (!table)
+        return;
+
+    for (int i = 0; i < table->num_entries; i++) {
+        free(table->entries[i].name);
+        free(table->entries[i].value);
+    }
+    free(table->entries);
+    table->entries     = NULL;
+    table->num_entries = 0;
+    table->max_entries = 0;
+    table->size        = 0;
+}
+
+static size_t entry_size(const hpack_entry_t* entry) {
+    return entry->name_length + entry->value_length + ENTRY_OVERHEAD;
+}
+
+// Evict the oldest entries until the table fits in max_size
+static void evict_entries(hpack_table_t* table, size_t max_size) {
+    int evicted = 0;
+    while (evicted < table->num_entries && table->size > max_size) {
+        hpack_entry_t* entry  = &table->entries[evicted];
+        table->size          -= entry_size(entry);
+        free(entry->name);
+        free(entry->value);
+        evicted++;
+    }
+
+    if (evicted > 0) {
+        table->num_entries -= evicted;
+        memmove(table->entries, table->entries + evicted,
+                table->num_entries * sizeof(hpack_entry_t));
+    }
+}
+
+void hpack_table_set_max_size(hpack_table_t* table, size_t max_size) {
+    if (!table)
+        return;
+
+    table->max_size = max_size;
+    evict_entries(table, max_size);
+}
+
+static int add_entry(hpack_table_t* table, const char* name,
+                     size_t name_length, const char* value,
+                     size_t value_length) {
+    size_t size = name_length + value_length + ENTRY_OVERHEAD;
+
+    // An entry larger than the table empties it and is not added
+    if (size > table->max_size) {
+        evict_entries(table, 0);
+        return 0;
+    }
+
+    // The name may point into an entry that is about to be evicted, so
+    // copy it before evicting (RFC 7541 section 4.4)
+    char* name_copy  = malloc(name_length + 1);
+    char* value_copy = malloc(value_length + 1);
+    if (!name_copy || !value_copy) {
+        free(name_copy);
+        free(value_copy);
+        return -1;
+    }
+    memcpy(name_copy, name, name_length);
+    name_copy[name_length] = '\0';
+    memcpy(value_copy, value, value_length);
+    value_copy[value_length] = '\0';
+
+    evict_entries(table, table->max_size - size);
+
+    if (table->num_entries >= table->max_entries) {
+        int new_size = table->max_entries ? table->max_entries * 2 : 16;
+        hpack_entry_t* new_entries =
+            realloc(table->entries, new_size * sizeof(hpack_entry_t));
+        if (!new_entries) {
+            free(name_copy);
+            free(value_copy);
+            return -1;
+        }
+        table->entries     = new_entries;
+        table->max_entries = new_size;
+    }
+
+    hpack_entry_t* entry = &table->entries[table->num_entries];
+    entry->name          = name_copy;
+    entry->value         = value_copy;
+    entry->name_length   = name_length;
+    entry->value_length  = value_length;
+
+    table->num_entries++;
+    table->size += size;
+    return 0;
+}
+
+// Look up an entry by its HPACK index (static entries first, then the
+// dynamic table from newest to oldest)
+static int lookup_entry(const hpack_table_t* table, size_t index,
+                        const char** name, size_t* name_length,
+                        const char** value, size_t* value_length) {
+    if (index == 0)
+        return -1;
+
+    if (index <= STATIC_TABLE_SIZE) {
+        *name         = static_table[index - 1].name;
+        *name_length  = strlen(*name);
+        *value        = static_table[index - 1].value;
+        *value_length = strlen(*value);
+        return 0;
+    }
+
+    index -= STATIC_TABLE_SIZE + 1;
+    if (index >= (size_t)table->num_entries)
+        return -1;
+
+    const hpack_entry_t* entry =
+        &table->entries[table->num_entries - 1 - index];
+    *name         = entry->name;
+    *name_length  = entry->name_length;
+    *value        = entry->value;
+    *value_length = entry->value_length;
+    return 0;
+}
+
+// Decode an integer with an N-bit prefix (RFC 7541 section 5.1)
+static int decode_integer(const uint8_t** pos, const uint8_t* end,
+                          int prefix_bits, size_t* value) {
+    if (*pos >= end)
+        return -1;
+
+    size_t max_prefix = (1 << prefix_bits) - 1;
+    *value            = **pos & max_prefix;
+    (*pos)++;
+
+    if (*value < max_prefix)
+        return 0;
+
+    int shift = 0;
+    while (*pos < end) {
+        uint8_t byte  = **pos;
+        (*pos)++;
+        *value       += (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return 0;
+        shift += 7;
+        if (shift > 28)
+            return -1;
+    }
+
+    return -1;
+}
+
+// Decode a string literal (RFC 7541 section 5.2) into a newly allocated
+// buffer
+static int decode_string(const uint8_t** pos, const uint8_t* end,
+                         char** out, size_t* out_length) {
+    if (*pos >= end)
+        return -1;
+
+    int huffman = **pos & 0x80;
+    size_t length;
+    if (decode_integer(pos, end, 7, &length) != 0)
+        return -1;
+    if (length > (size_t)(end - *pos) || length > MAX_STRING_LENGTH)
+        return -1;
+
+    if (huffman) {
+        *out = malloc(length * 8 / 5 + 1);
+        if (!*out)
+            return -1;
+        long decoded = huffman_decode(*pos, length, *out);
+        if (decoded < 0) {
+            free(*out);
+            return -1;
+        }
+        *out_length = decoded;
+    } else {
+        *out = malloc(length + 1);
+        if (!*out)
+            return -1;
+        memcpy(*out, *pos, length);
+        *out_length = length;
+    }
+
+    (*out)[*out_length]  = '\0';
+    *pos                += length;
+    return 0;
+}
+
+int hpack_decode(hpack_table_t* table, const uint8_t* block, size_t length,
+                 size_t limit, hpack_header_cb callback, void* arg) {
+    if (!table || (!block && length > 0) || !callback)
+        return -1;
+
+    const uint8_t* pos = block;
+    const uint8_t* end = block + length;
+
+    while (pos < end) {
+        uint8_t byte = *pos;
+        size_t index;
+
+        if (byte & 0x80) {
+            // Indexed header field
+            const char *name, *value;
+            size_t name_length, value_length;
+            if (decode_integer(&pos, end, 7, &index) != 0 ||
+                lookup_entry(table, index, &name, &name_length, &value,
+                             &value_length) != 0)
+                return -1;
+            if (callback(arg, name, name_length, value, value_length) != 0)
+                return -1;
+            continue;
+        }
+
+        if ((byte & 0xe0) == 0x20) {
+            // Dynamic table size update
+            size_t new_size;
+            if (decode_integer(&pos, end, 5, &new_size) != 0 ||
+                new_size > limit)
+                return -1;
+            hpack_table_set_max_size(table, new_size);
+            continue;
+        }
+
+        // Literal header field, with incremental indexing (01), without
+        // indexing (0000) or never indexed (0001)
+        int incremental = (byte & 0xc0) == 0x40;
+        if (decode_integer(&pos, end, incremental ? 6 : 4, &index) != 0)
+            return -1;
+
+        char* name_copy = NULL;
+        const char* name;
+        size_t name_length;
+        if (index > 0) {
+            const char* unused_value;
+            size_t unused_length;
+            if (lookup_entry(table, index, &name, &name_length,
+                             &unused_value, &unused_length) != 0)
+                return -1;
+        } else {
+            if (decode_string(&pos, end, &name_copy, &name_length) != 0)
+                return -1;
+            name = name_copy;
+        }
+
+        char* value;
+        size_t value_length;
+        if (decode_string(&pos, end, &value, &value_length) != 0) {
+            free(name_copy);
+            return -1;
+        }
+
+        int result = callback(arg, name, name_length, value, value_length);
+        if (result == 0 && incremental)
+            result = add_entry(table, name, name_length, value, value_length);
+
+        free(name_copy);
+        free(value);
+        if (result != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Encode an integer with an N-bit prefix, or'ing the prefix into flags
+static int encode_integer(uint8_t* buffer, size_t buffer_size, uint8_t flags,
+                          int prefix_bits, size_t value) {
+    if (buffer_size == 0)
+        return -1;
+
+    size_t max_prefix = (1 << prefix_bits) - 1;
+    if (value < max_prefix) {
+        buffer[0] = flags | value;
+        return 1;
+    }
+
+    buffer[0]      = flags | max_prefix;
+    value         -= max_prefix;
+    size_t offset  = 1;
+    while (value >= 0x80) {
+        if (offset >= buffer_size)
+            return -1;
+        buffer[offset++]   = (value & 0x7f) | 0x80;
+        value            >>= 7;
+    }
+    if (offset >= buffer_size)
+        return -1;
+    buffer[offset++] = value;
+
+    return offset;
+}
+
+// Encode a raw (non-Huffman) string literal
+static int encode_string(uint8_t* buffer, size_t buffer_size,
+                         const char* string, size_t length) {
+    int offset = encode_integer(buffer, buffer_size, 0x00, 7, length);
+    if (offset < 0 || offset + length > buffer_size)
+        return -1;
+
+    memcpy(buffer + offset, string, length);
+    return offset + length;
+}
+
+int hpack_encode_table_size(uint8_t* buffer, size_t buffer_size,
+                            size_t table_size) {
+    return encode_integer(buffer, buffer_size, 0x20, 5, table_size);
+}
+
+// Find the best index for a header: an exact match if there is one,
+// otherwise a name-only match (negated), otherwise 0
+static int find_index(const hpack_table_t* table, const char* name,
+                      const char* value) {
+    int name_index = 0;
+
+    for (int i = 0; i < STATIC_TABLE_SIZE; i++) {
+        if (strcmp(static_table[i].name, name) != 0)
+            continue;
+        if (strcmp(static_table[i].value, value) == 0)
+            return i + 1;
+        if (!name_index)
+            name_index = -(i + 1);
+    }
+
+    for (int i = table->num_entries - 1; i >= 0; i--) {
+        const hpack_entry_t* entry = &table->entries[i];
+        int index = STATIC_TABLE_SIZE + table->num_entries - i;
+        if (strcmp(entry->name, name) != 0)
+            continue;
+        if (strcmp(entry->value, value) == 0)
+            return index;
+        if (!name_index)
+            name_index = -index;
+    }
+
+    return name_index;
+}
+
+// Headers whose values change on nearly every response are not worth a
+// dynamic table slot
+static int should_index(const char* name) {
+    return strcmp(name, ":status") != 0 &&
+           strcmp(name, "content-length") != 0 && strcmp(name, "date") != 0;
+}
+
+int hpack_encode_header(hpack_table_t* table, uint8_t* buffer,
+                        size_t buffer_size, const char* name,
+                        const char* value) {
+    if (!table || !buffer || !name || !value)
+        return -1;
+
+    int index = find_index(table, name, value);
+    if (index > 0)
+        return encode_integer(buffer, buffer_size, 0x80, 7, index);
+
+    int incremental = should_index(name);
+    int offset;
+    if (incremental)
+        offset = encode_integer(buffer, buffer_size, 0x40, 6, -index);
+    else
+        offset = encode_integer(buffer, buffer_size, 0x00, 4, -index);
+    if (offset < 0)
+        return -1;
+
+    if (index == 0) {
+        int written = encode_string(buffer + offset, buffer_size - offset,
+                                    name, strlen(name));
+        if (written < 0)
+            return -1;
+        offset += written;
+    }
+
+    int written = encode_string(buffer + offset, buffer_size - offset, value,
+                                strlen(value));
+    if (written < 0)
+        return -1;
+    offset += written;
+
+    if (incremental &&
+        add_entry(table, name, strlen(name), value, strlen(value)) != 0)
+        return -1;
+
+    return offset;
+}
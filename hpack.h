@@ -0,0 +1,95 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct {
+    char* name;
+    char* value;
+    size_t name_length;
+    size_t value_length;
+} hpack_entry_t;
+
+// Dynamic table shared by one side of an HTTP/2 connection. Entries are
+// stored oldest first, so the newest entry is the last one.
+typedef struct {
+    hpack_entry_t* entries;
+    int num_entries;
+    int max_entries;
+    size_t size;
+    size_t max_size;
+} hpack_table_t;
+
+/**
+ * Callback invoked for every decoded header field
+ * @param arg User argument passed to hpack_decode()
+ * @param name Header name (not null-terminated)
+ * @param name_length Length of the name
+ * @param value Header value (not null-terminated)
+ * @param value_length Length of the value
+ * @return 0 to continue, non-zero to abort decoding
+ */
+typedef int (*hpack_header_cb)(void* arg, const char* name,
+                               size_t name_length, const char* value,
+                               size_t value_length);
+
+/**
+ * Initialize a dynamic table
+ * @param table Pointer to the table to initialize
+ * @param max_size Maximum table size in bytes
+ */
+void hpack_table_init(hpack_table_t* table, size_t max_size);
+
+/**
+ * Free resources used by a dynamic table
+ * @param table Pointer to the table
+ */
+void hpack_table_free(hpack_table_t* table);
+
+/**
+ * Change the maximum size of a dynamic table, evicting entries as needed
+ * @param table Pointer to the table
+ * @param max_size New maximum size in bytes
+ */
+void hpack_table_set_max_size(hpack_table_t* table, size_t max_size);
+
+/**
+ * Decode a complete header block
+ * @param table Decoder dynamic table
+ * @param block Header block data
+ * @param length Length of the header block
+ * @param limit Largest table size the encoder is allowed to switch to
+ * @param callback Function called for every header field
+ * @param arg User argument passed to the callback
+ * @return 0 on success, non-zero on a compression error
+ */
+int hpack_decode(hpack_table_t* table, const uint8_t* block, size_t length,
+                 size_t limit, hpack_header_cb callback, void* arg);
+
+/**
+ * Encode a dynamic table size update
+ * @param buffer Buffer to write to
+ * @param buffer_size Size of the buffer
+ * @param table_size New table size
+ * @return Number of bytes written, or -1 if the buffer is too small
+ */
+int hpack_encode_table_size(uint8_t* buffer, size_t buffer_size,
+                            size_t table_size);
+
+/**
+ * Encode a header field, adding it to the dynamic table when useful
+ * @param table Encoder dynamic table
+ * @param buffer Buffer to write to
+ * @param buffer_size Size of the buffer
+ * @param name Header name (must be lowercase)
+ * @param value Header value
+ * @return Number of bytes written, or -1 if the buffer is too small
+ */
+int hpack_encode_header(hpack_table_t* table, uint8_t* buffer,
+                        size_t buffer_size, const char* name,
+                        const char* value);
+
+#endif /* HPACK_H */
@@ -0,0 +1,1033 @@
+#include "http2.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "connection.h"
+#include "hpack.h"
+#include "response.h"
+#include "route_handlers.h"
+#include "scan.h"
+
+#define FRAME_HEADER_SIZE 9
+#define DEFAULT_MAX_FRAME_SIZE 16384
+#define MAX_FRAME_SIZE_LIMIT 16777215
+#define DEFAULT_WINDOW_SIZE 65535
+#define MAX_WINDOW_SIZE 0x7fffffff
+#define MAX_CONCURRENT_STREAMS 100
+#define MAX_HEADER_BLOCK_SIZE 65536
+#define RESPONSE_BLOCK_SIZE 8192
+#define READ_BUFFER_SIZE (FRAME_HEADER_SIZE + DEFAULT_MAX_FRAME_SIZE)
+
+// Frame types
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_PRIORITY 0x2
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PUSH_PROMISE 0x5
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+
+// Frame flags
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+// Settings identifiers
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+
+// Error codes
+#define ERROR_NONE 0x0
+#define ERROR_PROTOCOL 0x1
+#define ERROR_INTERNAL 0x2
+#define ERROR_FLOW_CONTROL 0x3
+#define ERROR_FRAME_SIZE 0x6
+#define ERROR_REFUSED_STREAM 0x7
+#define ERROR_COMPRESSION 0x9
+
+typedef struct http2_connection http2_connection_t;
+
+typedef struct http2_stream {
+    uint32_t id;
+    int64_t send_window;
+    int reset;      // Set when the client cancels the stream
+    int malformed;  // A field contained CR, LF or NUL
+    http_request_t request;
+    http2_connection_t* conn;
+    struct http2_stream* next;
+} http2_stream_t;
+
+struct http2_connection {
+    int fd;
+    int local_peer;  // Copied into every stream's request
+
+    // Serializes frame writes and guards the encoder, so HPACK-encoded
+    // header blocks reach the client in encoding order. Held for one frame
+    // at a time; taken before lock when both are needed.
+    pthread_mutex_t write_lock;
+    hpack_table_t encoder;
+
+    // The lock guards the fields below. It is never held across a write,
+    // so a slow response cannot stall the reader or other streams.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // Signalled on window updates and stream exits
+    size_t table_size;        // Encoder table size the client asked for
+    long pending_table_size;  // Table size update to announce, or -1
+    int64_t send_window;
+    int64_t initial_window;
+    size_t max_frame_size;
+    atomic_int dead;  // Set once the socket is unusable
+    int active_streams;
+    http2_stream_t* streams;
+    int goaway_received;
+    int reading_stopped;  // No more WINDOW_UPDATE credit can arrive
+
+    // Reader state, only touched by the connection thread
+    hpack_table_t decoder;
+    uint32_t last_stream_id;
+    uint8_t* header_block;
+    size_t header_block_length;
+    uint32_t header_stream_id;
+    pool_buffer_t buffer;  // Only held while a frame is being read
+    size_t buffer_start;
+    size_t buffer_end;
+};
+
+static uint32_t read_uint32(const uint8_t* data) {
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+           ((uint32_t)data[2] << 8) | data[3];
+}
+
+static void write_uint32(uint8_t* data, uint32_t value) {
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+}
+
+static void write_frame_header(uint8_t* header, size_t length, uint8_t type,
+                               uint8_t flags, uint32_t stream_id) {
+    header[0] = length >> 16;
+    header[1] = length >> 8;
+    header[2] = length;
+    header[3] = type;
+    header[4] = flags;
+    write_uint32(header + 5, stream_id & MAX_WINDOW_SIZE);
+}
+
+// Must hold conn->lock
+static void mark_dead(http2_connection_t* conn) {
+    conn->dead = 1;
+    pthread_cond_broadcast(&conn->cond);
+}
+
+static void write_failed(http2_connection_t* conn) {
+    pthread_mutex_lock(&conn->lock);
+    mark_dead(conn);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Write a frame with an in-memory payload. Must hold conn->write_lock.
+static int write_frame(http2_connection_t* conn, uint8_t type, uint8_t flags,
+                       uint32_t stream_id, const void* payload,
+                       size_t length) {
+    uint8_t frame[FRAME_HEADER_SIZE + DEFAULT_MAX_FRAME_SIZE];
+
+    if (conn->dead || length > DEFAULT_MAX_FRAME_SIZE)
+        return -1;
+
+    write_frame_header(frame, length, type, flags, stream_id);
+    if (length > 0)
+        memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+
+    if (send_all(conn->fd, frame, FRAME_HEADER_SIZE + length, 0) != 0) {
+        write_failed(conn);
+        return -1;
+    }
+    return 0;
+}
+
+// Write a DATA frame whose payload comes straight from a file via
+// sendfile(). Must hold conn->write_lock.
+static int write_file_frame(http2_connection_t* conn, uint8_t flags,
+                            uint32_t stream_id, int file_fd, off_t offset,
+                            size_t length) {
+    uint8_t header[FRAME_HEADER_SIZE];
+
+    if (conn->dead)
+        return -1;
+
+    write_frame_header(header, length, FRAME_DATA, flags, stream_id);
+    if (send_all(conn->fd, header, FRAME_HEADER_SIZE, MSG_MORE) != 0 ||
+        send_file_all(conn->fd, file_fd, offset, length) != 0) {
+        write_failed(conn);
+        return -1;
+    }
+    return 0;
+}
+
+static void send_rst_stream(http2_connection_t* conn, uint32_t stream_id,
+                            uint32_t error_code) {
+    uint8_t payload[4];
+    write_uint32(payload, error_code);
+
+    pthread_mutex_lock(&conn->write_lock);
+    write_frame(conn, FRAME_RST_STREAM, 0, stream_id, payload, 4);
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+static void send_goaway(http2_connection_t* conn, uint32_t error_code) {
+    uint8_t payload[8];
+    write_uint32(payload, conn->last_stream_id);
+    write_uint32(payload + 4, error_code);
+
+    pthread_mutex_lock(&conn->write_lock);
+    write_frame(conn, FRAME_GOAWAY, 0, 0, payload, 8);
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+static void send_window_update(http2_connection_t* conn, uint32_t stream_id,
+                               uint32_t increment) {
+    uint8_t payload[4];
+    write_uint32(payload, increment);
+
+    pthread_mutex_lock(&conn->write_lock);
+    write_frame(conn, FRAME_WINDOW_UPDATE, 0, stream_id, payload, 4);
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+static http2_stream_t* find_stream(http2_connection_t* conn, uint32_t id) {
+    for (http2_stream_t* stream = conn->streams; stream; stream = stream->next)
+        if (stream->id == id)
+            return stream;
+    return NULL;
+}
+
+// Headers that are specific to HTTP/1.x connections and must not appear in
+// HTTP/2 responses
+static int is_connection_header(const char* name) {
+    return strcasecmp(name, "Connection") == 0 ||
+           strcasecmp(name, "Keep-Alive") == 0 ||
+           strcasecmp(name, "Proxy-Connection") == 0 ||
+           strcasecmp(name, "Transfer-Encoding") == 0 ||
+           strcasecmp(name, "Upgrade") == 0;
+}
+
+static int has_response_header(const http_response_t* response,
+                               const char* name) {
+    for (int i = 0; i < response->num_headers; i++)
+        if (strcasecmp(response->header_names[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+static int encode_field(http2_connection_t* conn, uint8_t* block,
+                        size_t* offset, const char* name, const char* value) {
+    int written = hpack_encode_header(&conn->encoder, block + *offset,
+                                      RESPONSE_BLOCK_SIZE - *offset, name,
+                                      value);
+    if (written < 0)
+        return -1;
+    *offset += written;
+    return 0;
+}
+
+// Encode and send the response header block for a stream, split into
+// HEADERS and CONTINUATION frames as needed. Must hold conn->write_lock.
+static int write_response_headers(http2_connection_t* conn,
+                                  const http2_stream_t* stream,
+                                  const http_response_t* response,
+                                  int end_stream) {
+    uint8_t block[RESPONSE_BLOCK_SIZE];
+    size_t offset = 0;
+
+    pthread_mutex_lock(&conn->lock);
+    long table_size          = conn->pending_table_size;
+    conn->pending_table_size = -1;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (table_size >= 0) {
+        hpack_table_set_max_size(&conn->encoder, table_size);
+        int written = hpack_encode_table_size(block, sizeof(block),
+                                              table_size);
+        if (written < 0)
+            return -1;
+        offset += written;
+    }
+
+    char value[64];
+    snprintf(value, sizeof(value), "%d", response->status_code);
+    int result = encode_field(conn, block, &offset, ":status", value);
+
+    if (result == 0 && response->content_type &&
+        !has_response_header(response, "Content-Type"))
+        result = encode_field(conn, block, &offset, "content-type",
+                              response->content_type);
+
+    if (result == 0 && !has_response_header(response, "Content-Length")) {
+        snprintf(value, sizeof(value), "%zu", response->content_length);
+        result = encode_field(conn, block, &offset, "content-length", value);
+    }
+
+    for (int i = 0; result == 0 && i < response->num_headers; i++) {
+        if (is_connection_header(response->header_names[i]))
+            continue;
+
+        // HTTP/2 header names are lowercase
+        char name[MAX_HEADER_NAME_LENGTH];
+        size_t j;
+        for (j = 0; j < sizeof(name) - 1 && response->header_names[i][j]; j++)
+            name[j] = tolower((unsigned char)response->header_names[i][j]);
+        name[j] = '\0';
+
+        result = encode_field(conn, block, &offset, name,
+                              response->header_values[i]);
+    }
+
+    // A partly encoded block leaves the encoder table out of sync with the
+    // client, so the connection cannot continue
+    if (result != 0) {
+        write_failed(conn);
+        return -1;
+    }
+
+    size_t sent = 0;
+    do {
+        size_t chunk = offset - sent;
+        if (chunk > conn->max_frame_size)
+            chunk = conn->max_frame_size;
+
+        uint8_t type  = sent == 0 ? FRAME_HEADERS : FRAME_CONTINUATION;
+        uint8_t flags = 0;
+        if (sent + chunk == offset)
+            flags |= FLAG_END_HEADERS;
+        if (sent == 0 && end_stream)
+            flags |= FLAG_END_STREAM;
+
+        if (write_frame(conn, type, flags, stream->id, block + sent, chunk) !=
+            0)
+            return -1;
+        sent += chunk;
+    } while (sent < offset);
+
+    return 0;
+}
+
+// Send a response on a stream, waiting for flow-control credit as needed.
+// The write lock is taken per frame, so streams interleave their DATA.
+static void send_stream_response(http2_stream_t* stream,
+                                 const http_response_t* response) {
+    http2_connection_t* conn = stream->conn;
+    size_t remaining         = response->content_length;
+    size_t sent              = 0;
+
+    if (!response->content && response->file_fd < 0)
+        remaining = 0;
+
+    pthread_mutex_lock(&conn->write_lock);
+    pthread_mutex_lock(&conn->lock);
+    int reset = stream->reset;
+    pthread_mutex_unlock(&conn->lock);
+    int result = reset ? -1
+                       : write_response_headers(conn, stream, response,
+                                                remaining == 0);
+    pthread_mutex_unlock(&conn->write_lock);
+
+    while (result == 0 && remaining > 0) {
+        pthread_mutex_lock(&conn->lock);
+        while (!conn->dead && !stream->reset && !conn->reading_stopped &&
+               (conn->send_window <= 0 || stream->send_window <= 0))
+            pthread_cond_wait(&conn->cond, &conn->lock);
+
+        if (conn->dead || stream->reset || conn->send_window <= 0 ||
+            stream->send_window <= 0) {
+            pthread_mutex_unlock(&conn->lock);
+            break;
+        }
+
+        size_t chunk = remaining;
+        if (chunk > conn->max_frame_size)
+            chunk = conn->max_frame_size;
+        if ((int64_t)chunk > conn->send_window)
+            chunk = conn->send_window;
+        if ((int64_t)chunk > stream->send_window)
+            chunk = stream->send_window;
+
+        // Claim the credit before letting go of the lock
+        conn->send_window   -= chunk;
+        stream->send_window -= chunk;
+        pthread_mutex_unlock(&conn->lock);
+
+        uint8_t flags = chunk == remaining ? FLAG_END_STREAM : 0;
+        pthread_mutex_lock(&conn->write_lock);
+        if (response->file_fd >= 0)
+            result = write_file_frame(conn, flags, stream->id,
+                                      response->file_fd,
+                                      response->file_offset + sent, chunk);
+        else
+            result = write_frame(conn, FRAME_DATA, flags, stream->id,
+                                 response->content + sent, chunk);
+        pthread_mutex_unlock(&conn->write_lock);
+
+        sent      += chunk;
+        remaining -= chunk;
+    }
+}
+
+// Thread function serving a single stream
+static void* handle_stream(void* arg) {
+    http2_stream_t* stream   = arg;
+    http2_connection_t* conn = stream->conn;
+
+    http_response_t response;
+    init_response(&response);
+    route_request(&stream->request, &response);
+    send_stream_response(stream, &response);
+    free_response(&response);
+
+    pthread_mutex_lock(&conn->lock);
+    http2_stream_t** link = &conn->streams;
+    while (*link != stream)
+        link = &(*link)->next;
+    *link = stream->next;
+    conn->active_streams--;
+    pthread_cond_broadcast(&conn->cond);
+
+    // After a client GOAWAY the reader only waits for the last stream, and
+    // may be blocked in recv(); end its read side so it returns
+    if (conn->goaway_received && conn->active_streams == 0)
+        shutdown(conn->fd, SHUT_RD);
+    pthread_mutex_unlock(&conn->lock);
+
+    free(stream);
+    return NULL;
+}
+
+// Register a stream and hand it to its own thread. Takes ownership of the
+// stream structure.
+static void start_stream(http2_connection_t* conn, http2_stream_t* stream) {
+    pthread_mutex_lock(&conn->lock);
+    if (conn->active_streams >= MAX_CONCURRENT_STREAMS) {
+        pthread_mutex_unlock(&conn->lock);
+        send_rst_stream(conn, stream->id, ERROR_REFUSED_STREAM);
+        free(stream);
+        return;
+    }
+    stream->conn        = conn;
+    stream->send_window = conn->initial_window;
+    stream->next        = conn->streams;
+    conn->streams       = stream;
+    conn->active_streams++;
+    pthread_mutex_unlock(&conn->lock);
+
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, handle_stream, stream) != 0) {
+        perror("Failed to create stream thread");
+        pthread_mutex_lock(&conn->lock);
+        conn->streams = stream->next;
+        conn->active_streams--;
+        pthread_mutex_unlock(&conn->lock);
+        send_rst_stream(conn, stream->id, ERROR_INTERNAL);
+        free(stream);
+        return;
+    }
+
+    pthread_detach(thread_id);
+}
+
+// Apply one setting sent by the client. Returns 0 or an error code.
+static uint32_t apply_setting(http2_connection_t* conn, uint16_t id,
+                              uint32_t value) {
+    switch (id) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            if (value > HPACK_DEFAULT_TABLE_SIZE)
+                value = HPACK_DEFAULT_TABLE_SIZE;
+            // The encoder is resized by the next header block, under the
+            // write lock
+            if (value != conn->table_size) {
+                conn->table_size         = value;
+                conn->pending_table_size = value;
+            }
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > MAX_WINDOW_SIZE)
+                return ERROR_FLOW_CONTROL;
+            int64_t delta        = (int64_t)value - conn->initial_window;
+            conn->initial_window = value;
+            for (http2_stream_t* stream = conn->streams; stream;
+                 stream                 = stream->next) {
+                stream->send_window += delta;
+                if (stream->send_window > MAX_WINDOW_SIZE)
+                    return ERROR_FLOW_CONTROL;
+            }
+            pthread_cond_broadcast(&conn->cond);
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < DEFAULT_MAX_FRAME_SIZE || value > MAX_FRAME_SIZE_LIMIT)
+                return ERROR_PROTOCOL;
+            // Larger frames would not fit our write buffers
+            conn->max_frame_size = DEFAULT_MAX_FRAME_SIZE;
+            break;
+        default:
+            // Unknown or irrelevant settings are ignored
+            break;
+    }
+    return ERROR_NONE;
+}
+
+static uint32_t apply_settings(http2_connection_t* conn,
+                               const uint8_t* payload, size_t length) {
+    uint32_t error = ERROR_NONE;
+
+    pthread_mutex_lock(&conn->lock);
+    for (size_t i = 0; i + 6 <= length && error == ERROR_NONE; i += 6) {
+        uint16_t id = (payload[i] << 8) | payload[i + 1];
+        error       = apply_setting(conn, id, read_uint32(payload + i + 2));
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    return error;
+}
+
+static void send_settings(http2_connection_t* conn) {
+    uint8_t payload[6];
+    payload[0] = 0;
+    payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    write_uint32(payload + 2, MAX_CONCURRENT_STREAMS);
+
+    pthread_mutex_lock(&conn->write_lock);
+    write_frame(conn, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+static void copy_field(char* dest, size_t dest_size, const char* src,
+                       size_t length) {
+    if (length >= dest_size)
+        length = dest_size - 1;
+    memcpy(dest, src, length);
+    dest[length] = '\0';
+}
+
+static void add_request_header(http_request_t* request, const char* name,
+                               size_t name_length, const char* value,
+                               size_t value_length) {
+    if (request->num_headers >= MAX_HEADERS)
+        return;
+
+    http_header_t* header = &request->headers[request->num_headers++];
+    if (name_length >= MAX_HEADER_NAME_LENGTH)
+        name_length = MAX_HEADER_NAME_LENGTH - 1;
+    header->name_hash = scan_copy_name(header->name, name, name_length);
+    copy_field(header->value, MAX_HEADER_VALUE_LENGTH, value, value_length);
+}
+
+// CR, LF and NUL are never valid in a field (RFC 9113 section 8.2.1).
+// Letting them through would allow header injection once the request is
+// written out as HTTP/1.1, for example by the proxy.
+static int has_invalid_bytes(const char* data, size_t length) {
+    for (size_t i = 0; i < length; i++)
+        if (data[i] == '\r' || data[i] == '\n' || data[i] == '\0')
+            return 1;
+    return 0;
+}
+
+// HPACK callback filling a stream's request from decoded fields
+static int on_request_header(void* arg, const char* name, size_t name_length,
+                             const char* value, size_t value_length) {
+    http2_stream_t* stream  = arg;
+    http_request_t* request = &stream->request;
+
+    // Keep decoding so the table stays in sync; the stream is reset after
+    if (has_invalid_bytes(name, name_length) ||
+        has_invalid_bytes(value, value_length)) {
+        stream->malformed = 1;
+        return 0;
+    }
+
+    if (name_length == 7 && memcmp(name, ":method", 7) == 0)
+        copy_field(request->method, sizeof(request->method), value,
+                   value_length);
+    else if (name_length == 5 && memcmp(name, ":path", 5) == 0)
+        copy_field(request->path, sizeof(request->path), value, value_length);
+    else if (name_length == 10 && memcmp(name, ":authority", 10) == 0)
+        add_request_header(request, "host", 4, value, value_length);
+    else if (name_length > 0 && name[0] != ':')
+        add_request_header(request, name, name_length, value, value_length);
+
+    return 0;
+}
+
+// Decode a complete request header block and start its stream. Returns 0
+// or a connection error code.
+static uint32_t process_header_block(http2_connection_t* conn) {
+    uint32_t stream_id = conn->header_stream_id;
+
+    http2_stream_t* stream = calloc(1, sizeof(http2_stream_t));
+    if (!stream)
+        return ERROR_INTERNAL;
+    stream->id = stream_id;
+    strcpy(stream->request.http_version, "HTTP/2.0");
+    stream->request.local_peer = conn->local_peer;
+
+    // The block must be decoded even for streams we refuse, to keep the
+    // decoder table in sync
+    int result = hpack_decode(&conn->decoder, conn->header_block,
+                              conn->header_block_length,
+                              HPACK_DEFAULT_TABLE_SIZE, on_request_header,
+                              stream);
+
+    free(conn->header_block);
+    conn->header_block        = NULL;
+    conn->header_block_length = 0;
+    conn->header_stream_id    = 0;
+
+    if (result != 0) {
+        free(stream);
+        return ERROR_COMPRESSION;
+    }
+
+    // Trailers or headers for a stream we already know about are ignored
+    if (stream_id <= conn->last_stream_id) {
+        free(stream);
+        return ERROR_NONE;
+    }
+    conn->last_stream_id = stream_id;
+
+    if (stream->malformed || !stream->request.method[0] ||
+        !stream->request.path[0]) {
+        free(stream);
+        send_rst_stream(conn, stream_id, ERROR_PROTOCOL);
+        return ERROR_NONE;
+    }
+
+    start_stream(conn, stream);
+    return ERROR_NONE;
+}
+
+static uint32_t append_header_block(http2_connection_t* conn,
+                                    const uint8_t* data, size_t length,
+                                    uint8_t flags) {
+    if (conn->header_block_length + length > MAX_HEADER_BLOCK_SIZE)
+        return ERROR_PROTOCOL;
+
+    uint8_t* block =
+        realloc(conn->header_block, conn->header_block_length + length + 1);
+    if (!block)
+        return ERROR_INTERNAL;
+    memcpy(block + conn->header_block_length, data, length);
+    conn->header_block         = block;
+    conn->header_block_length += length;
+
+    if (flags & FLAG_END_HEADERS)
+        return process_header_block(conn);
+    return ERROR_NONE;
+}
+
+// Strip padding (and priority data for HEADERS) from a frame payload
+static int strip_padding(const uint8_t** payload, size_t* length,
+                         uint8_t flags, size_t extra) {
+    size_t padding = 0;
+    if (flags & FLAG_PADDED) {
+        if (*length < 1)
+            return -1;
+        padding = (*payload)[0];
+        (*payload)++;
+        (*length)--;
+    }
+    if (*length < extra + padding)
+        return -1;
+    *payload += extra;
+    *length  -= extra + padding;
+    return 0;
+}
+
+// Handle one frame from the client. Returns 0 or a connection error code.
+static uint32_t handle_frame(http2_connection_t* conn, uint8_t type,
+                             uint8_t flags, uint32_t stream_id,
+                             const uint8_t* payload, size_t length) {
+    // A header block must not be interleaved with other frames
+    if (conn->header_block_length > 0 || conn->header_block) {
+        if (type != FRAME_CONTINUATION || stream_id != conn->header_stream_id)
+            return ERROR_PROTOCOL;
+        return append_header_block(conn, payload, length, flags);
+    }
+
+    switch (type) {
+        case FRAME_DATA: {
+            if (stream_id == 0)
+                return ERROR_PROTOCOL;
+            // Request bodies are not used by any handler, but the flow
+            // control credit they consumed must be returned
+            if (length > 0) {
+                send_window_update(conn, 0, length);
+                if (!(flags & FLAG_END_STREAM))
+                    send_window_update(conn, stream_id, length);
+            }
+            return ERROR_NONE;
+        }
+
+        case FRAME_HEADERS: {
+            if (stream_id == 0 || (stream_id & 1) == 0)
+                return ERROR_PROTOCOL;
+            size_t extra = (flags & FLAG_PRIORITY) ? 5 : 0;
+            if (strip_padding(&payload, &length, flags, extra) != 0)
+                return ERROR_PROTOCOL;
+            conn->header_stream_id = stream_id;
+            return append_header_block(conn, payload, length, flags);
+        }
+
+        case FRAME_PRIORITY:
+            return ERROR_NONE;
+
+        case FRAME_RST_STREAM: {
+            if (stream_id == 0 || length != 4)
+                return ERROR_PROTOCOL;
+            pthread_mutex_lock(&conn->lock);
+            http2_stream_t* stream = find_stream(conn, stream_id);
+            if (stream) {
+                stream->reset = 1;
+                pthread_cond_broadcast(&conn->cond);
+            }
+            pthread_mutex_unlock(&conn->lock);
+            return ERROR_NONE;
+        }
+
+        case FRAME_SETTINGS: {
+            if (stream_id != 0)
+                return ERROR_PROTOCOL;
+            if (flags & FLAG_ACK)
+                return length == 0 ? ERROR_NONE : ERROR_FRAME_SIZE;
+            if (length % 6 != 0)
+                return ERROR_FRAME_SIZE;
+
+            uint32_t error = apply_settings(conn, payload, length);
+            if (error != ERROR_NONE)
+                return error;
+
+            pthread_mutex_lock(&conn->write_lock);
+            write_frame(conn, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+            pthread_mutex_unlock(&conn->write_lock);
+            return ERROR_NONE;
+        }
+
+        case FRAME_PUSH_PROMISE:
+            // Only servers may push
+            return ERROR_PROTOCOL;
+
+        case FRAME_PING:
+            if (stream_id != 0)
+                return ERROR_PROTOCOL;
+            if (length != 8)
+                return ERROR_FRAME_SIZE;
+            if (!(flags & FLAG_ACK)) {
+                pthread_mutex_lock(&conn->write_lock);
+                write_frame(conn, FRAME_PING, FLAG_ACK, 0, payload, 8);
+                pthread_mutex_unlock(&conn->write_lock);
+            }
+            return ERROR_NONE;
+
+        case FRAME_GOAWAY:
+            pthread_mutex_lock(&conn->lock);
+            conn->goaway_received = 1;
+            pthread_mutex_unlock(&conn->lock);
+            return ERROR_NONE;
+
+        case FRAME_WINDOW_UPDATE: {
+            if (length != 4)
+                return ERROR_FRAME_SIZE;
+            uint32_t increment = read_uint32(payload) & MAX_WINDOW_SIZE;
+            if (increment == 0)
+                return stream_id == 0 ? ERROR_PROTOCOL : ERROR_NONE;
+
+            uint32_t error = ERROR_NONE;
+            pthread_mutex_lock(&conn->lock);
+            if (stream_id == 0) {
+                conn->send_window += increment;
+                if (conn->send_window > MAX_WINDOW_SIZE)
+                    error = ERROR_FLOW_CONTROL;
+            } else {
+                http2_stream_t* stream = find_stream(conn, stream_id);
+                if (stream) {
+                    stream->send_window += increment;
+                    if (stream->send_window > MAX_WINDOW_SIZE)
+                        stream->reset = 1;
+                }
+            }
+            pthread_cond_broadcast(&conn->cond);
+            pthread_mutex_unlock(&conn->lock);
+            return error;
+        }
+
+        case FRAME_CONTINUATION:
+            // Only valid while a header block is in progress
+            return ERROR_PROTOCOL;
+
+        default:
+            // Unknown frame types must be ignored
+            return ERROR_NONE;
+    }
+}
+
+// Wait until the socket is readable, without holding a buffer
+static int wait_readable(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int result;
+    do {
+        result = poll(&pfd, 1, -1);
+    } while (result < 0 && errno == EINTR);
+    return result < 0 ? -1 : 0;
+}
+
+// Make sure at least `needed` bytes are buffered. An idle connection holds
+// no buffer, so one is borrowed from the pool once data arrives.
+static int fill_buffer(http2_connection_t* conn, size_t needed) {
+    if (conn->buffer_end - conn->buffer_start >= needed)
+        return 0;
+
+    if (!conn->buffer.data) {
+        if (wait_readable(conn->fd) != 0 ||
+            buffer_pool_acquire(&conn->buffer, READ_BUFFER_SIZE) != 0)
+            return -1;
+        conn->buffer_start = 0;
+        conn->buffer_end   = 0;
+    }
+
+    if (conn->buffer_start + needed > conn->buffer.size) {
+        memmove(conn->buffer.data, conn->buffer.data + conn->buffer_start,
+                conn->buffer_end - conn->buffer_start);
+        conn->buffer_end   -= conn->buffer_start;
+        conn->buffer_start  = 0;
+    }
+
+    // The buffer handed over by the HTTP/1 reader may be a small class
+    if (conn->buffer.size < READ_BUFFER_SIZE &&
+        buffer_pool_grow(&conn->buffer, conn->buffer_end,
+                         READ_BUFFER_SIZE) != 0)
+        return -1;
+
+    while (conn->buffer_end - conn->buffer_start < needed) {
+        ssize_t bytes =
+            recv(conn->fd, conn->buffer.data + conn->buffer_end,
+                 conn->buffer.size - conn->buffer_end, 0);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return -1;
+        conn->buffer_end += bytes;
+    }
+    return 0;
+}
+
+// Read and dispatch frames until the client goes away. After a GOAWAY,
+// frames are still read until the active streams finish, since they may
+// need WINDOW_UPDATE credit. Returns 0 or the connection error code to
+// report in GOAWAY.
+static uint32_t read_frames(http2_connection_t* conn) {
+    if (fill_buffer(conn, HTTP2_PREFACE_LENGTH) != 0)
+        return ERROR_NONE;
+    if (memcmp(conn->buffer.data + conn->buffer_start, HTTP2_PREFACE,
+               HTTP2_PREFACE_LENGTH) != 0)
+        return ERROR_PROTOCOL;
+    conn->buffer_start += HTTP2_PREFACE_LENGTH;
+
+    for (;;) {
+        if (conn->goaway_received) {
+            pthread_mutex_lock(&conn->lock);
+            int finished = conn->active_streams == 0;
+            pthread_mutex_unlock(&conn->lock);
+            if (finished)
+                break;
+        }
+
+        if (fill_buffer(conn, FRAME_HEADER_SIZE) != 0)
+            return ERROR_NONE;
+
+        const uint8_t* header =
+            (const uint8_t*)conn->buffer.data + conn->buffer_start;
+        size_t length      = (header[0] << 16) | (header[1] << 8) | header[2];
+        uint8_t type       = header[3];
+        uint8_t flags      = header[4];
+        uint32_t stream_id = read_uint32(header + 5) & MAX_WINDOW_SIZE;
+
+        if (length > DEFAULT_MAX_FRAME_SIZE)
+            return ERROR_FRAME_SIZE;
+        if (fill_buffer(conn, FRAME_HEADER_SIZE + length) != 0)
+            return ERROR_NONE;
+
+        const uint8_t* payload = header + FRAME_HEADER_SIZE;
+        uint32_t error =
+            handle_frame(conn, type, flags, stream_id, payload, length);
+        conn->buffer_start += FRAME_HEADER_SIZE + length;
+
+        if (error != ERROR_NONE)
+            return error;
+
+        // Hand the buffer back while no partial frame is pending
+        if (conn->buffer_start == conn->buffer_end)
+            buffer_pool_release(&conn->buffer);
+    }
+
+    return ERROR_NONE;
+}
+
+// Decode base64url without padding, as used by the HTTP2-Settings header
+static long decode_base64url(const char* input, uint8_t* output,
+                             size_t output_size) {
+    size_t length  = 0;
+    uint32_t bits  = 0;
+    int bit_count  = 0;
+
+    for (; *input && *input != '='; input++) {
+        int value;
+        if (*input >= 'A' && *input <= 'Z')
+            value = *input - 'A';
+        else if (*input >= 'a' && *input <= 'z')
+            value = *input - 'a' + 26;
+        else if (*input >= '0' && *input <= '9')
+            value = *input - '0' + 52;
+        else if (*input == '-' || *input == '+')
+            value = 62;
+        else if (*input == '_' || *input == '/')
+            value = 63;
+        else
+            return -1;
+
+        bits       = (bits << 6) | value;
+        bit_count += 6;
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            if (length >= output_size)
+                return -1;
+            output[length++] = (bits >> bit_count) & 0xff;
+        }
+    }
+
+    return length;
+}
+
+int http2_is_preface(const char* data, size_t length) {
+    if (!data || length < 4)
+        return 0;
+
+    if (length > HTTP2_PREFACE_LENGTH)
+        length = HTTP2_PREFACE_LENGTH;
+    return memcmp(data, HTTP2_PREFACE, length) == 0;
+}
+
+int http2_is_upgrade_request(const http_request_t* request) {
+    if (!request || strcmp(request->http_version, "HTTP/1.1") != 0)
+        return 0;
+
+    const char* upgrade  = get_header_value(request, "Upgrade");
+    const char* settings = get_header_value(request, "HTTP2-Settings");
+    return upgrade && settings && strcasecmp(upgrade, "h2c") == 0;
+}
+
+void http2_serve_connection(int client_fd, pool_buffer_t* buffer,
+                            size_t length,
+                            const http_request_t* upgrade_request) {
+    http2_connection_t* conn = calloc(1, sizeof(http2_connection_t));
+    if (!conn) {
+        buffer_pool_release(buffer);
+        return;
+    }
+
+    conn->fd                 = client_fd;
+    conn->local_peer         = connection_is_local(client_fd);
+    conn->pending_table_size = -1;
+    conn->send_window        = DEFAULT_WINDOW_SIZE;
+    conn->initial_window     = DEFAULT_WINDOW_SIZE;
+    conn->max_frame_size     = DEFAULT_MAX_FRAME_SIZE;
+    conn->table_size         = HPACK_DEFAULT_TABLE_SIZE;
+    pthread_mutex_init(&conn->write_lock, NULL);
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->cond, NULL);
+    hpack_table_init(&conn->encoder, HPACK_DEFAULT_TABLE_SIZE);
+    hpack_table_init(&conn->decoder, HPACK_DEFAULT_TABLE_SIZE);
+
+    if (buffer && buffer->data) {
+        conn->buffer     = *buffer;
+        conn->buffer_end = length;
+        buffer->data     = NULL;
+    }
+
+    uint32_t error = ERROR_NONE;
+
+    if (upgrade_request) {
+        const char* switching =
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Connection: Upgrade\r\n"
+            "Upgrade: h2c\r\n"
+            "\r\n";
+        if (send_all(client_fd, switching, strlen(switching), 0) != 0)
+            conn->dead = 1;
+
+        uint8_t settings[256];
+        long settings_length = decode_base64url(
+            get_header_value(upgrade_request, "HTTP2-Settings"), settings,
+            sizeof(settings));
+        if (settings_length < 0 || settings_length % 6 != 0)
+            error = ERROR_PROTOCOL;
+        else
+            error = apply_settings(conn, settings, settings_length);
+    }
+
+    send_settings(conn);
+
+    if (upgrade_request && error == ERROR_NONE && !conn->dead) {
+        // The upgrade request is answered on stream 1
+        http2_stream_t* stream = calloc(1, sizeof(http2_stream_t));
+        if (stream) {
+            stream->id      = 1;
+            stream->request = *upgrade_request;
+            strcpy(stream->request.http_version, "HTTP/2.0");
+            conn->last_stream_id = 1;
+            start_stream(conn, stream);
+        }
+    }
+
+    if (error == ERROR_NONE && !conn->dead)
+        error = read_frames(conn);
+
+    if (error != ERROR_NONE)
+        send_goaway(conn, error);
+
+    // Wait for in-flight streams. After a GOAWAY from the client they may
+    // still finish their responses; otherwise the connection is gone.
+    // Either way streams waiting for credit cannot get any more.
+    pthread_mutex_lock(&conn->lock);
+    conn->reading_stopped = 1;
+    pthread_cond_broadcast(&conn->cond);
+    if (error != ERROR_NONE || !conn->goaway_received)
+        mark_dead(conn);
+    while (conn->active_streams > 0)
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    pthread_mutex_unlock(&conn->lock);
+
+    buffer_pool_release(&conn->buffer);
+    free(conn->header_block);
+    hpack_table_free(&conn->encoder);
+    hpack_table_free(&conn->decoder);
+    pthread_cond_destroy(&conn->cond);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_mutex_destroy(&conn->write_lock);
+    free(conn);
+}
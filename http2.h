@@ -0,0 +1,42 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stddef.h>
+
+#include "buffer_pool.h"
+#include "request.h"
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LENGTH 24
+
+/**
+ * Check whether received data starts with the HTTP/2 client preface
+ * @param data Data received from the client
+ * @param length Length of the data
+ * @return 1 if the data is (the start of) the preface, 0 otherwise
+ */
+int http2_is_preface(const char* data, size_t length);
+
+/**
+ * Check whether an HTTP/1.1 request asks to upgrade to h2c
+ * @param request The parsed HTTP/1.1 request
+ * @return 1 if the request carries a valid h2c upgrade, 0 otherwise
+ */
+int http2_is_upgrade_request(const http_request_t* request);
+
+/**
+ * Serve an HTTP/2 connection until the client closes it. Streams are
+ * dispatched concurrently to the route handlers.
+ * @param client_fd Connected client socket
+ * @param buffer Pool buffer holding bytes already read from the socket
+ *               (starting with the preface), or NULL. The connection takes
+ *               ownership of it.
+ * @param length Number of bytes already read
+ * @param upgrade_request The HTTP/1.1 request that asked for h2c, which is
+ *                        answered on stream 1, or NULL for prior knowledge
+ */
+void http2_serve_connection(int client_fd, pool_buffer_t* buffer,
+                            size_t length,
+                            const http_request_t* upgrade_request);
+
+#endif /* HTTP2_H */
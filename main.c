@@ -3,35 +3,202 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "buffer_pool.h"
 #include "server.h"
 
 void print_usage(const char* program_name) {
-    printf("Usage: %s [-p port]\n", program_name);
-    printf("  -p port    Port to listen on (default: 80)\n");
+    printf("Usage: %s [-p port] [-b backlog] [-d seconds] [-f qlen] [-n] [-N] "
+           "[-B usec] [-c cert -k key] [-P pack [-l]] [-H bytes] "
+           "[-T n [-t file]]"
+           " [-r rate [-R burst]] [-L rate] [-x host:port]..."
+           " [-m prefix=ms]... [-S bytes] [-u path] [-W n]\n",
+           program_name);
+    printf("  -p port    Port to listen on, 0 for none (default: 80)\n");
+    printf("  -b backlog Listen backlog (default: 100)\n");
+    printf("  -d seconds TCP_DEFER_ACCEPT timeout (default: off)\n");
+    printf("  -f qlen    TCP_FASTOPEN queue length (default: off)\n");
+    printf("  -n         Set TCP_NODELAY on client sockets\n");
+    printf("  -N         Cork response headers and body with TCP_CORK\n");
+    printf("  -B usec    SO_BUSY_POLL budget in microseconds (default: off)\n");
+    printf("  -c cert    PEM certificate chain, serves HTTPS when set\n");
+    printf("  -k key     PEM private key for the certificate\n");
+    printf("  -P pack    Serve /static/ from an asset pack (make pack)\n");
+    printf("  -l         Lock the asset pack in memory\n");
+    printf("  -H bytes   Largest request header block (default: 65536)\n");
+    printf("  -T n       Trace one in every n requests (default: off)\n");
+    printf("  -t file    Trace file written on SIGUSR1 "
+           "(default: trace.json)\n");
+    printf("  -r rate    Requests per second per client (default: off)\n");
+    printf("  -R burst   Requests a client may burst (default: rate)\n");
+    printf("  -L rate    Requests per second per client and route "
+           "(default: off)\n");
+    printf("  -x addr    Upstream host:port for /proxy/ (repeatable)\n");
+    printf("  -m route   Micro-cache a path prefix, as prefix=ttl_ms "
+           "(repeatable)\n");
+    printf("  -S bytes   Micro-cache memory limit (default: 16777216)\n");
+    printf("  -u path    Also listen on a Unix domain socket\n");
+    printf("  -W n       Serve connections as coroutines on n worker threads "
+           "(default: a thread per connection)\n");
 }
 
 int main(int argc, char* argv[]) {
-    int port = 80;
+    server_config_t config;
+    init_server_config(&config);
     int opt;
 
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt(argc, argv,
+                         "p:b:d:f:nNB:c:k:P:lH:T:t:r:R:L:x:m:S:u:W:")) != -1) {
         switch (opt) {
             case 'p':
-                port = atoi(optarg);
-                if (port <= 0 || port > 65535) {
+                config.port = atoi(optarg);
+                if (config.port < 0 || config.port > 65535) {
                     fprintf(stderr, "Invalid port number\n");
                     return EXIT_FAILURE;
                 }
                 break;
+            case 'b':
+                config.backlog = atoi(optarg);
+                if (config.backlog <= 0) {
+                    fprintf(stderr, "Invalid backlog\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                config.defer_accept = atoi(optarg);
+                if (config.defer_accept < 0) {
+                    fprintf(stderr, "Invalid defer accept timeout\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'f':
+                config.fastopen = atoi(optarg);
+                if (config.fastopen < 0) {
+                    fprintf(stderr, "Invalid fast open queue length\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                config.nodelay = 1;
+                break;
+            case 'N':
+                config.cork = 1;
+                break;
+            case 'B':
+                config.busy_poll = atoi(optarg);
+                if (config.busy_poll < 0) {
+                    fprintf(stderr, "Invalid busy poll budget\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                config.cert_file = optarg;
+                break;
+            case 'k':
+                config.key_file = optarg;
+                break;
+            case 'P':
+                config.asset_pack = optarg;
+                break;
+            case 'l':
+                config.lock_assets = 1;
+                break;
+            case 'H':
+                config.max_header_size = atoi(optarg);
+                if (config.max_header_size <= 0 ||
+                    config.max_header_size >= BUFFER_POOL_MAX_SIZE) {
+                    fprintf(stderr, "Invalid header size limit\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'T':
+                config.trace_sample_rate = atoi(optarg);
+                if (config.trace_sample_rate <= 0) {
+                    fprintf(stderr, "Invalid trace sample rate\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                config.trace_file = optarg;
+                break;
+            case 'r':
+                config.rate_limit = atoi(optarg);
+                if (config.rate_limit <= 0) {
+                    fprintf(stderr, "Invalid rate limit\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'R':
+                config.rate_burst = atoi(optarg);
+                if (config.rate_burst <= 0) {
+                    fprintf(stderr, "Invalid rate limit burst\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'L':
+                config.route_rate_limit = atoi(optarg);
+                if (config.route_rate_limit <= 0) {
+                    fprintf(stderr, "Invalid route rate limit\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'x':
+                if (config.num_upstreams >= MAX_UPSTREAMS) {
+                    fprintf(stderr, "Too many upstreams (at most %d)\n",
+                            MAX_UPSTREAMS);
+                    return EXIT_FAILURE;
+                }
+                config.upstreams[config.num_upstreams++] = optarg;
+                break;
+            case 'm':
+                if (config.num_cached_routes >= MAX_CACHED_ROUTES) {
+                    fprintf(stderr, "Too many cached routes (at most %d)\n",
+                            MAX_CACHED_ROUTES);
+                    return EXIT_FAILURE;
+                }
+                config.cached_routes[config.num_cached_routes++] = optarg;
+                break;
+            case 'S':
+                config.cache_size = atol(optarg);
+                if (config.cache_size <= 0) {
+                    fprintf(stderr, "Invalid cache size\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'u':
+                config.unix_socket = optarg;
+                break;
+            case 'W':
+                config.workers = atoi(optarg);
+                if (config.workers <= 0) {
+                    fprintf(stderr, "Invalid number of workers\n");
+                    return EXIT_FAILURE;
+                }
+                break;
             default:
                 print_usage(argv[0]);
                 return EXIT_FAILURE;
         }
     }
 
-    printf("Starting server on port %d\n", port);
+    if (!config.cert_file != !config.key_file) {
+        fprintf(stderr, "Both -c and -k are required for TLS\n");
+        return EXIT_FAILURE;
+    }
+
+    if (config.port == 0 && !config.unix_socket) {
+        fprintf(stderr, "-p 0 requires a Unix socket (-u)\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!config.unix_socket)
+        printf("Starting server on port %d\n", config.port);
+    else if (config.port == 0)
+        printf("Starting server on %s\n", config.unix_socket);
+    else
+        printf("Starting server on port %d and %s\n", config.port,
+               config.unix_socket);
 
-    if (start_server(port) != 0) {
+    if (start_server(&config) != 0) {
         fprintf(stderr, "Failed to start server\n");
         return EXIT_FAILURE;
     }
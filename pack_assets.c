@@ -0,0 +1,288 @@
+// Build-time tool that packs a static directory into a single file for
+// asset_pack_open(). Usage: pack_assets <static dir> <output file>
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "asset_pack.h"
+#include "utils.h"
+
+typedef struct {
+    char path[PATH_MAX];  // Relative to the static directory
+    char* data;
+    size_t length;
+    int gzip_variant;  // Index of the .gz variant, or -1
+    int is_variant;    // This file is the .gz variant of another asset
+    char etag[32];
+    asset_pack_entry_t entry;
+} pack_file_t;
+
+static pack_file_t* files = NULL;
+static int num_files      = 0;
+static int max_files      = 0;
+
+static char* read_file(const char* filename, size_t* length) {
+    FILE* file = fopen(filename, "rb");
+    if (!file)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fileno(file), &st) < 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    char* data = malloc(st.st_size + 1);
+    if (data && fread(data, 1, st.st_size, file) != (size_t)st.st_size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+
+    *length = st.st_size;
+    return data;
+}
+
+static int collect_files(const char* root, const char* relative) {
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", root, relative);
+
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        perror(dir_path);
+        return -1;
+    }
+
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        // Skip ., .. and hidden files such as .DS_Store
+        if (dirent->d_name[0] == '.')
+            continue;
+
+        char path[PATH_MAX];
+        char full_path[PATH_MAX + 256];
+        if (snprintf(path, sizeof(path), "%s%s%s", relative,
+                     relative[0] ? "/" : "",
+                     dirent->d_name) >= (int)sizeof(path))
+            continue;
+        snprintf(full_path, sizeof(full_path), "%s/%s", root, path);
+
+        struct stat st;
+        if (stat(full_path, &st) < 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            if (collect_files(root, path) != 0) {
+                closedir(dir);
+                return -1;
+            }
+            continue;
+        }
+        if (!S_ISREG(st.st_mode))
+            continue;
+
+        if (num_files >= max_files) {
+            max_files            = max_files ? max_files * 2 : 64;
+            pack_file_t* resized = realloc(files, max_files * sizeof(*files));
+            if (!resized) {
+                closedir(dir);
+                return -1;
+            }
+            files = resized;
+        }
+
+        pack_file_t* file = &files[num_files];
+        memset(file, 0, sizeof(*file));
+        snprintf(file->path, sizeof(file->path), "%s", path);
+        file->gzip_variant = -1;
+        file->data         = read_file(full_path, &file->length);
+        if (!file->data) {
+            perror(full_path);
+            closedir(dir);
+            return -1;
+        }
+        num_files++;
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+// Attach "<name>.gz" files to "<name>" as precompressed variants
+static void match_variants(void) {
+    for (int i = 0; i < num_files; i++) {
+        size_t length = strlen(files[i].path);
+        if (length <= 3 || strcmp(files[i].path + length - 3, ".gz") != 0)
+            continue;
+
+        for (int j = 0; j < num_files; j++) {
+            if (strlen(files[j].path) == length - 3 &&
+                strncmp(files[j].path, files[i].path, length - 3) == 0) {
+                files[j].gzip_variant = i;
+                files[i].is_variant   = 1;
+                break;
+            }
+        }
+    }
+}
+
+static uint64_t align(uint64_t offset) {
+    uint64_t mask = ASSET_PACK_ALIGNMENT - 1;
+    return (offset + mask) & ~mask;
+}
+
+static int write_padding(FILE* out, uint64_t from, uint64_t to) {
+    for (; from < to; from++)
+        if (fputc(0, out) == EOF)
+            return -1;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <static dir> <output file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (collect_files(argv[1], "") != 0)
+        return EXIT_FAILURE;
+    match_variants();
+
+    // Build the string table and count the assets
+    uint32_t num_entries = 0;
+    size_t strings_size  = 0;
+    size_t strings_max   = 4096;
+    char* strings        = malloc(strings_max);
+    if (!strings)
+        return EXIT_FAILURE;
+
+    for (int i = 0; i < num_files; i++) {
+        pack_file_t* file = &files[i];
+        if (file->is_variant)
+            continue;
+        num_entries++;
+
+        snprintf(file->etag, sizeof(file->etag), "\"%016llx\"",
+                 (unsigned long long)asset_pack_hash(file->data,
+                                                     file->length));
+
+        const char* values[3] = {file->path, get_mime_type(file->path),
+                                 file->etag};
+        uint32_t* offsets[3]  = {&file->entry.path_offset,
+                                 &file->entry.mime_offset,
+                                 &file->entry.etag_offset};
+        for (int j = 0; j < 3; j++) {
+            size_t length = strlen(values[j]) + 1;
+            while (strings_size + length > strings_max) {
+                strings_max *= 2;
+                strings      = realloc(strings, strings_max);
+                if (!strings)
+                    return EXIT_FAILURE;
+            }
+            memcpy(strings + strings_size, values[j], length);
+            *offsets[j]   = strings_size;
+            strings_size += length;
+        }
+        file->entry.hash = asset_pack_hash(file->path, strlen(file->path));
+    }
+
+    // Keep the hash table at most half full
+    uint32_t num_slots = 16;
+    while (num_slots < num_entries * 2)
+        num_slots *= 2;
+
+    asset_pack_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic          = ASSET_PACK_MAGIC;
+    header.version        = ASSET_PACK_VERSION;
+    header.num_slots      = num_slots;
+    header.num_entries    = num_entries;
+    header.slots_offset   = sizeof(header);
+    header.entries_offset = header.slots_offset + num_slots * sizeof(uint32_t);
+    header.strings_offset =
+        header.entries_offset + num_entries * sizeof(asset_pack_entry_t);
+    header.strings_size = strings_size;
+
+    // Lay out file contents on page boundaries
+    uint64_t offset = align(header.strings_offset + strings_size);
+    for (int i = 0; i < num_files; i++) {
+        pack_file_t* file = &files[i];
+        if (file->is_variant)
+            continue;
+
+        file->entry.data_offset  = offset;
+        file->entry.data_length  = file->length;
+        offset                   = align(offset + file->length);
+
+        if (file->gzip_variant >= 0) {
+            pack_file_t* variant     = &files[file->gzip_variant];
+            file->entry.gzip_offset  = offset;
+            file->entry.gzip_length  = variant->length;
+            offset                   = align(offset + variant->length);
+        }
+    }
+
+    uint32_t* slots = calloc(num_slots, sizeof(uint32_t));
+    if (!slots)
+        return EXIT_FAILURE;
+
+    asset_pack_entry_t* entries = calloc(num_entries + 1, sizeof(*entries));
+    if (!entries)
+        return EXIT_FAILURE;
+
+    uint32_t index = 0;
+    for (int i = 0; i < num_files; i++) {
+        if (files[i].is_variant)
+            continue;
+
+        entries[index] = files[i].entry;
+        uint32_t slot  = entries[index].hash & (num_slots - 1);
+        while (slots[slot] != 0)
+            slot = (slot + 1) & (num_slots - 1);
+        slots[slot] = ++index;
+    }
+
+    FILE* out = fopen(argv[2], "wb");
+    if (!out) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    int failed = fwrite(&header, sizeof(header), 1, out) != 1 ||
+                 fwrite(slots, sizeof(uint32_t), num_slots, out) != num_slots ||
+                 fwrite(entries, sizeof(*entries), num_entries, out) !=
+                     num_entries ||
+                 fwrite(strings, 1, strings_size, out) != strings_size;
+
+    uint64_t position = header.strings_offset + strings_size;
+    for (int i = 0; i < num_files && !failed; i++) {
+        pack_file_t* file = &files[i];
+        if (file->is_variant)
+            continue;
+
+        const pack_file_t* parts[2] = {
+            file, file->gzip_variant >= 0 ? &files[file->gzip_variant] : NULL};
+        uint64_t offsets[2] = {file->entry.data_offset,
+                               file->entry.gzip_offset};
+        for (int j = 0; j < 2 && parts[j] && !failed; j++) {
+            failed = write_padding(out, position, offsets[j]) != 0 ||
+                     fwrite(parts[j]->data, 1, parts[j]->length, out) !=
+                         parts[j]->length;
+            position = offsets[j] + parts[j]->length;
+        }
+    }
+
+    if (fclose(out) != 0 || failed) {
+        fprintf(stderr, "Failed to write %s\n", argv[2]);
+        remove(argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    printf("Packed %u assets into %s (%llu bytes)\n", num_entries, argv[2],
+           (unsigned long long)position);
+    return EXIT_SUCCESS;
+}
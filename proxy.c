@@ -0,0 +1,749 @@
+#define _GNU_SOURCE
+#include "proxy.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "connection.h"
+#include "coroutine.h"
+#include "server.h"
+
+#define POOL_SIZE 32  // Idle connections kept per upstream
+#define IDLE_TIMEOUT 30  // Seconds an idle connection is kept
+#define IO_TIMEOUT 10  // Seconds to wait on a slow upstream
+#define CONNECT_TIMEOUT_MS 1000
+#define HEALTH_INTERVAL 5  // Seconds between health probes
+#define MAX_RESPONSE_HEADER (64 * 1024)
+#define MAX_FORWARDED_HEADERS 8192  // Header bytes copied to the client
+#define MAX_BODY_SIZE (16 * 1024 * 1024)
+#define READ_SIZE 16384
+#define REQUEST_SIZE 4096
+
+// Outcomes of one request/response exchange with an upstream
+#define EXCHANGE_OK 0
+#define EXCHANGE_RETRY 1  // Nothing came back, the request can be retried
+#define EXCHANGE_FAILED 2  // Broken or invalid response
+#define EXCHANGE_TIMEOUT 3  // The upstream stopped answering
+
+typedef struct {
+    int fd;
+    time_t idle_since;
+} idle_connection_t;
+
+// A backend server with its pool of idle keep-alive connections. Pools are
+// shared by all threads: connection threads only live for one client
+// connection, so a pool per thread would never see a connection reused.
+typedef struct {
+    char name[256];  // "host:port", also sent as the Host header
+    struct sockaddr_storage addr;
+    socklen_t addr_length;
+    atomic_int healthy;
+    pthread_mutex_t lock;
+    idle_connection_t idle[POOL_SIZE];
+    int num_idle;
+} upstream_t;
+
+// Growable body of an upstream response
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} body_t;
+
+// Buffered reader over an upstream socket
+typedef struct {
+    int fd;
+    pool_buffer_t buffer;
+    size_t start;
+    size_t end;
+} reader_t;
+
+static upstream_t upstreams[MAX_UPSTREAMS];
+static int num_upstreams = 0;
+static atomic_uint next_upstream;
+
+// Hop-by-hop headers, which only apply to a single connection
+static int is_hop_by_hop(const char* name) {
+    return strcasecmp(name, "Connection") == 0 ||
+           strcasecmp(name, "Keep-Alive") == 0 ||
+           strcasecmp(name, "Proxy-Connection") == 0 ||
+           strcasecmp(name, "Proxy-Authenticate") == 0 ||
+           strcasecmp(name, "Proxy-Authorization") == 0 ||
+           strcasecmp(name, "TE") == 0 || strcasecmp(name, "Trailer") == 0 ||
+           strcasecmp(name, "Transfer-Encoding") == 0 ||
+           strcasecmp(name, "Upgrade") == 0 ||
+           strcasecmp(name, "HTTP2-Settings") == 0;
+}
+
+// Responses carry a borrowed status text, so upstream reasons are mapped
+// back to the standard ones
+static const struct {
+    int code;
+    const char* text;
+} reason_phrases[] = {
+    {200, "OK"},
+    {201, "Created"},
+    {202, "Accepted"},
+    {204, "No Content"},
+    {206, "Partial Content"},
+    {301, "Moved Permanently"},
+    {302, "Found"},
+    {303, "See Other"},
+    {304, "Not Modified"},
+    {307, "Temporary Redirect"},
+    {308, "Permanent Redirect"},
+    {400, "Bad Request"},
+    {401, "Unauthorized"},
+    {403, "Forbidden"},
+    {404, "Not Found"},
+    {405, "Method Not Allowed"},
+    {429, "Too Many Requests"},
+    {500, "Internal Server Error"},
+    {502, "Bad Gateway"},
+    {503, "Service Unavailable"},
+    {504, "Gateway Timeout"},
+};
+
+static const char* reason_phrase(int code) {
+    for (size_t i = 0; i < sizeof(reason_phrases) / sizeof(reason_phrases[0]);
+         i++)
+        if (reason_phrases[i].code == code)
+            return reason_phrases[i].text;
+
+    if (code < 300)
+        return "OK";
+    if (code < 400)
+        return "Redirection";
+    return code < 500 ? "Client Error" : "Server Error";
+}
+
+static void set_error(http_response_t* response, int code) {
+    // Start over, the upstream may already have added headers
+    free_response(response);
+    init_response(response);
+
+    char message[64];
+    int length = snprintf(message, sizeof(message), "%d %s", code,
+                          reason_phrase(code));
+    set_response_status(response, code, reason_phrase(code));
+    set_response_content_type(response, "text/plain");
+    set_response_content(response, message, length);
+}
+
+static int parse_upstream(const char* address, upstream_t* upstream) {
+    const char* colon = strrchr(address, ':');
+    if (!colon || colon == address || !colon[1] ||
+        strlen(address) >= sizeof(upstream->name)) {
+        fprintf(stderr, "Invalid upstream %s, expected host:port\n", address);
+        return 1;
+    }
+
+    char host[256];
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* result;
+    int error = getaddrinfo(host, colon + 1, &hints, &result);
+    if (error != 0) {
+        fprintf(stderr, "Failed to resolve upstream %s: %s\n", address,
+                gai_strerror(error));
+        return 1;
+    }
+
+    memcpy(&upstream->addr, result->ai_addr, result->ai_addrlen);
+    upstream->addr_length = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    snprintf(upstream->name, sizeof(upstream->name), "%s", address);
+    atomic_init(&upstream->healthy, 1);
+    pthread_mutex_init(&upstream->lock, NULL);
+    upstream->num_idle = 0;
+    return 0;
+}
+
+// Open a new connection, giving up after CONNECT_TIMEOUT_MS. The socket is
+// switched back to blocking mode with I/O timeouts once connected.
+static int connect_upstream(const upstream_t* upstream) {
+    int fd = socket(upstream->addr.ss_family,
+                    SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (const struct sockaddr*)&upstream->addr,
+                upstream->addr_length) < 0) {
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        int error         = 0;
+        socklen_t length  = sizeof(error);
+        if (co_poll(&pfd, CONNECT_TIMEOUT_MS) <= 0 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 ||
+            error != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    struct timeval timeout = {IO_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Requests go out in a single write
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    return fd;
+}
+
+// An idle connection is unusable once it has been idle too long or is
+// readable: the upstream either closed it or sent something unexpected
+static int is_stale(const idle_connection_t* idle, time_t now) {
+    if (now - idle->idle_since > IDLE_TIMEOUT)
+        return 1;
+
+    struct pollfd pfd = {idle->fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) != 0;
+}
+
+// Take the most recently used idle connection, or open a new one
+static int acquire_connection(upstream_t* upstream, int* reused) {
+    time_t now = time(NULL);
+
+    for (;;) {
+        idle_connection_t idle;
+
+        pthread_mutex_lock(&upstream->lock);
+        int found = upstream->num_idle > 0;
+        if (found)
+            idle = upstream->idle[--upstream->num_idle];
+        pthread_mutex_unlock(&upstream->lock);
+
+        if (!found)
+            break;
+        if (!is_stale(&idle, now)) {
+            *reused = 1;
+            return idle.fd;
+        }
+        close(idle.fd);
+    }
+
+    *reused = 0;
+    return connect_upstream(upstream);
+}
+
+static void release_connection(upstream_t* upstream, int fd, int reusable) {
+    if (reusable) {
+        pthread_mutex_lock(&upstream->lock);
+        if (upstream->num_idle < POOL_SIZE) {
+            upstream->idle[upstream->num_idle].fd         = fd;
+            upstream->idle[upstream->num_idle].idle_since = time(NULL);
+            upstream->num_idle++;
+            fd = -1;
+        }
+        pthread_mutex_unlock(&upstream->lock);
+    }
+
+    if (fd >= 0)
+        close(fd);
+}
+
+// Close the idle connections of an upstream that went stale
+static void prune_idle(upstream_t* upstream) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&upstream->lock);
+    int kept = 0;
+    for (int i = 0; i < upstream->num_idle; i++) {
+        if (is_stale(&upstream->idle[i], now))
+            close(upstream->idle[i].fd);
+        else
+            upstream->idle[kept++] = upstream->idle[i];
+    }
+    upstream->num_idle = kept;
+    pthread_mutex_unlock(&upstream->lock);
+}
+
+static void set_healthy(upstream_t* upstream, int healthy) {
+    if (atomic_exchange(&upstream->healthy, healthy) != healthy)
+        printf("Upstream %s is %s\n", upstream->name, healthy ? "up" : "down");
+}
+
+// Probe every upstream with a connection attempt so failed ones are taken
+// out of the rotation and recovered ones are put back
+static void* health_check(void* arg) {
+    (void)arg;
+
+    for (;;) {
+        sleep(HEALTH_INTERVAL);
+
+        for (int i = 0; i < num_upstreams; i++) {
+            int fd = connect_upstream(&upstreams[i]);
+            set_healthy(&upstreams[i], fd >= 0);
+            if (fd >= 0)
+                close(fd);
+            prune_idle(&upstreams[i]);
+        }
+    }
+    return NULL;
+}
+
+int proxy_init(const char* const* addresses, int count) {
+    for (int i = 0; i < count; i++)
+        if (parse_upstream(addresses[i], &upstreams[i]))
+            return 1;
+    num_upstreams = count;
+
+    if (count == 0)
+        return 0;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, health_check, NULL) != 0) {
+        perror("Thread creation failed");
+        return 1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int proxy_enabled(void) {
+    return num_upstreams > 0;
+}
+
+// Round robin over the healthy upstreams. When none is healthy the next one
+// is tried anyway, it may have recovered since the last probe.
+static upstream_t* pick_upstream(void) {
+    unsigned start = atomic_fetch_add(&next_upstream, 1);
+
+    for (int i = 0; i < num_upstreams; i++) {
+        upstream_t* upstream = &upstreams[(start + i) % num_upstreams];
+        if (atomic_load(&upstream->healthy))
+            return upstream;
+    }
+    return &upstreams[start % num_upstreams];
+}
+
+// Check for CR or LF, which would let a field start a new header line (or
+// a new request) once build_request() copies it into the upstream request
+static int has_line_break(const char* text) {
+    return strpbrk(text, "\r\n") != NULL;
+}
+
+static int can_forward(const http_request_t* request, const char* path) {
+    if (has_line_break(request->method) || has_line_break(path))
+        return 0;
+    for (int i = 0; i < request->num_headers; i++)
+        if (has_line_break(request->headers[i].name) ||
+            has_line_break(request->headers[i].value))
+            return 0;
+    return 1;
+}
+
+// Write the request line and headers for the upstream into a pool buffer.
+// The fields are copied as they are, so callers check can_forward() first.
+static int build_request(const http_request_t* request, const char* path,
+                         const upstream_t* upstream, pool_buffer_t* buffer,
+                         size_t* length) {
+    if (buffer_pool_acquire(buffer, REQUEST_SIZE) != 0)
+        return -1;
+
+    for (;;) {
+        size_t size   = buffer->size;
+        size_t offset = snprintf(buffer->data, size,
+                                 "%s %s HTTP/1.1\r\nHost: %s\r\n",
+                                 request->method, path, upstream->name);
+
+        for (int i = 0; i < request->num_headers && offset < size; i++) {
+            const http_header_t* header = &request->headers[i];
+            if (is_hop_by_hop(header->name) ||
+                strcasecmp(header->name, "Host") == 0)
+                continue;
+            offset += snprintf(buffer->data + offset, size - offset,
+                               "%s: %s\r\n", header->name, header->value);
+        }
+        if (offset < size)
+            offset += snprintf(buffer->data + offset, size - offset, "\r\n");
+
+        if (offset < size) {
+            *length = offset;
+            return 0;
+        }
+
+        if (buffer_pool_grow(buffer, 0, size * 2) != 0) {
+            buffer_pool_release(buffer);
+            return -1;
+        }
+    }
+}
+
+static ssize_t recv_retry(int fd, void* buffer, size_t length) {
+    ssize_t bytes;
+    do {
+        bytes = co_recv(fd, buffer, length, 0);
+    } while (bytes < 0 && errno == EINTR);
+    return bytes;
+}
+
+// Read more data into the reader, compacting it first
+static ssize_t fill(reader_t* reader) {
+    if (reader->start > 0) {
+        memmove(reader->buffer.data, reader->buffer.data + reader->start,
+                reader->end - reader->start);
+        reader->end   -= reader->start;
+        reader->start  = 0;
+    }
+
+    if (reader->end == reader->buffer.size &&
+        buffer_pool_grow(&reader->buffer, reader->end,
+                         reader->buffer.size * 2) != 0)
+        return -1;
+
+    ssize_t bytes = recv_retry(reader->fd, reader->buffer.data + reader->end,
+                               reader->buffer.size - reader->end);
+    if (bytes > 0)
+        reader->end += bytes;
+    return bytes;
+}
+
+static int read_failure(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK ? EXCHANGE_TIMEOUT
+                                                   : EXCHANGE_FAILED;
+}
+
+// Read a CRLF-terminated line, returning its length without the CRLF
+static int read_line(reader_t* reader, char** line, size_t* length) {
+    for (;;) {
+        char* start = reader->buffer.data + reader->start;
+        char* end   = memmem(start, reader->end - reader->start, "\r\n", 2);
+        if (end) {
+            *line          = start;
+            *length        = end - start;
+            reader->start += *length + 2;
+            return EXCHANGE_OK;
+        }
+        if (reader->end - reader->start >= MAX_RESPONSE_HEADER)
+            return EXCHANGE_FAILED;
+
+        ssize_t bytes = fill(reader);
+        if (bytes == 0)
+            return EXCHANGE_FAILED;
+        if (bytes < 0)
+            return read_failure();
+    }
+}
+
+static int body_reserve(body_t* body, size_t extra) {
+    if (body->length + extra <= body->capacity)
+        return 0;
+    if (body->length + extra > MAX_BODY_SIZE)
+        return -1;
+
+    size_t capacity = body->capacity ? body->capacity : READ_SIZE;
+    while (capacity < body->length + extra)
+        capacity *= 2;
+
+    char* data = realloc(body->data, capacity);
+    if (!data)
+        return -1;
+    body->data     = data;
+    body->capacity = capacity;
+    return 0;
+}
+
+// Append exactly length bytes of body, taking what the reader has buffered
+// first and receiving the rest straight into the body
+static int read_body(reader_t* reader, body_t* body, size_t length) {
+    if (body_reserve(body, length) != 0)
+        return EXCHANGE_FAILED;
+
+    size_t buffered = reader->end - reader->start;
+    if (buffered > length)
+        buffered = length;
+    memcpy(body->data + body->length, reader->buffer.data + reader->start,
+           buffered);
+    reader->start += buffered;
+    body->length  += buffered;
+    length        -= buffered;
+
+    while (length > 0) {
+        ssize_t bytes = recv_retry(reader->fd, body->data + body->length,
+                                   length);
+        if (bytes == 0)
+            return EXCHANGE_FAILED;
+        if (bytes < 0)
+            return read_failure();
+        body->length += bytes;
+        length       -= bytes;
+    }
+    return EXCHANGE_OK;
+}
+
+static int read_chunked_body(reader_t* reader, body_t* body) {
+    for (;;) {
+        char* line;
+        size_t length;
+        int result = read_line(reader, &line, &length);
+        if (result != EXCHANGE_OK)
+            return result;
+
+        // Chunk size in hex, possibly followed by extensions
+        char* end;
+        errno              = 0;
+        unsigned long size = strtoul(line, &end, 16);
+        if (end == line || errno != 0 || size > MAX_BODY_SIZE)
+            return EXCHANGE_FAILED;
+
+        if (size == 0) {
+            // Skip trailers up to the final empty line
+            do {
+                result = read_line(reader, &line, &length);
+                if (result != EXCHANGE_OK)
+                    return result;
+            } while (length > 0);
+            return EXCHANGE_OK;
+        }
+
+        if ((result = read_body(reader, body, size)) != EXCHANGE_OK ||
+            (result = read_line(reader, &line, &length)) != EXCHANGE_OK)
+            return result;
+        if (length != 0)
+            return EXCHANGE_FAILED;
+    }
+}
+
+// Read until the upstream closes the connection
+static int read_body_until_close(reader_t* reader, body_t* body) {
+    for (;;) {
+        if (read_body(reader, body, reader->end - reader->start) !=
+            EXCHANGE_OK)
+            return EXCHANGE_FAILED;
+
+        ssize_t bytes = fill(reader);
+        if (bytes == 0)
+            return EXCHANGE_OK;
+        if (bytes < 0)
+            return read_failure();
+    }
+}
+
+// Check whether one of the first count response headers has this name
+static int has_header(const http_response_t* response, const char* name,
+                      int count) {
+    for (int i = 0; i < count; i++)
+        if (strcasecmp(response->header_names[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+// Parse the status line and headers, copying end-to-end headers into the
+// response. Sets the body framing and whether the connection stays open.
+static int read_response_head(reader_t* reader, http_response_t* response,
+                              long long* content_length, int* chunked,
+                              int* keep_alive) {
+    char* line;
+    size_t length;
+    int result = read_line(reader, &line, &length);
+    if (result != EXCHANGE_OK)
+        return result;
+
+    char status_line[64];
+    snprintf(status_line, sizeof(status_line), "%.*s", (int)length, line);
+    int minor_version, status_code;
+    if (sscanf(status_line, "HTTP/1.%d %d", &minor_version, &status_code) !=
+            2 ||
+        status_code < 100 || status_code > 999)
+        return EXCHANGE_FAILED;
+
+    set_response_status(response, status_code, reason_phrase(status_code));
+    *content_length = -1;
+    *chunked        = 0;
+    *keep_alive     = minor_version >= 1;
+
+    // Upstream headers replace the ones init_response() added (Server,
+    // Date) but are otherwise appended, so repeated ones such as Set-Cookie
+    // all reach the client
+    int own_headers  = response->num_headers;
+    size_t forwarded = 0;
+
+    for (;;) {
+        if ((result = read_line(reader, &line, &length)) != EXCHANGE_OK)
+            return result;
+        if (length == 0)
+            return EXCHANGE_OK;
+
+        char* colon = memchr(line, ':', length);
+        if (!colon || colon == line || colon - line >= MAX_HEADER_NAME_LENGTH)
+            continue;
+
+        char name[MAX_HEADER_NAME_LENGTH];
+        char value[MAX_HEADER_VALUE_LENGTH];
+        snprintf(name, sizeof(name), "%.*s", (int)(colon - line), line);
+
+        const char* value_start = colon + 1;
+        const char* value_end   = line + length;
+        while (value_start < value_end && isspace((unsigned char)*value_start))
+            value_start++;
+        while (value_end > value_start && isspace((unsigned char)value_end[-1]))
+            value_end--;
+        snprintf(value, sizeof(value), "%.*s", (int)(value_end - value_start),
+                 value_start);
+
+        if (strcasecmp(name, "Content-Length") == 0) {
+            *content_length = strtoll(value, NULL, 10);
+        } else if (strcasecmp(name, "Transfer-Encoding") == 0) {
+            *chunked = strcasestr(value, "chunked") != NULL;
+        } else if (strcasecmp(name, "Connection") == 0) {
+            if (strcasestr(value, "close"))
+                *keep_alive = 0;
+            else if (strcasestr(value, "keep-alive"))
+                *keep_alive = 1;
+        } else if (!is_hop_by_hop(name)) {
+            // An upstream must not be able to grow the client response
+            // without bound
+            forwarded += strlen(name) + strlen(value) + 4;
+            if (forwarded > MAX_FORWARDED_HEADERS)
+                return EXCHANGE_FAILED;
+            if (has_header(response, name, own_headers))
+                add_response_header(response, name, value);
+            else
+                append_response_header(response, name, value);
+        }
+    }
+}
+
+// Send one request and read the whole response into the response struct
+static int exchange(int fd, const char* request_data, size_t request_length,
+                    int head_request, http_response_t* response,
+                    int* reusable) {
+    *reusable = 0;
+    if (send_all(fd, request_data, request_length, MSG_NOSIGNAL) != 0)
+        return EXCHANGE_RETRY;
+
+    reader_t reader = {fd, {NULL, 0, 0}, 0, 0};
+    if (buffer_pool_acquire(&reader.buffer, READ_SIZE) != 0)
+        return EXCHANGE_FAILED;
+
+    // A kept-alive connection the upstream closed in the meantime shows up
+    // as end of file before any response data
+    ssize_t bytes = fill(&reader);
+    if (bytes <= 0) {
+        int timed_out = bytes < 0 && read_failure() == EXCHANGE_TIMEOUT;
+        buffer_pool_release(&reader.buffer);
+        return timed_out ? EXCHANGE_TIMEOUT : EXCHANGE_RETRY;
+    }
+
+    // Interim 1xx responses are skipped
+    long long content_length;
+    int chunked, keep_alive, result;
+    do {
+        result = read_response_head(&reader, response, &content_length,
+                                    &chunked, &keep_alive);
+    } while (result == EXCHANGE_OK && response->status_code < 200);
+
+    body_t body = {NULL, 0, 0};
+    int status  = response->status_code;
+    if (result == EXCHANGE_OK && !head_request && status != 204 &&
+        status != 304) {
+        if (chunked) {
+            result = read_chunked_body(&reader, &body);
+        } else if (content_length >= 0) {
+            result = content_length > MAX_BODY_SIZE
+                         ? EXCHANGE_FAILED
+                         : read_body(&reader, &body, content_length);
+        } else {
+            result     = read_body_until_close(&reader, &body);
+            keep_alive = 0;
+        }
+    }
+
+    // Leftover data means the upstream sent more than it framed
+    *reusable = result == EXCHANGE_OK && keep_alive &&
+                reader.start == reader.end;
+    buffer_pool_release(&reader.buffer);
+
+    if (result != EXCHANGE_OK) {
+        free(body.data);
+        return result;
+    }
+
+    set_response_content_owned(response, body.data, body.length);
+    if (head_request && content_length >= 0) {
+        char length_str[32];
+        snprintf(length_str, sizeof(length_str), "%lld", content_length);
+        add_response_header(response, "Content-Length", length_str);
+    }
+    return EXCHANGE_OK;
+}
+
+void proxy_forward(const http_request_t* request, const char* path,
+                   http_response_t* response) {
+    if (num_upstreams == 0) {
+        set_error(response, 503);
+        return;
+    }
+    if (!can_forward(request, path)) {
+        set_error(response, 400);
+        return;
+    }
+
+    pool_buffer_t buffer;
+    size_t length;
+    int head_request = strcmp(request->method, "HEAD") == 0;
+
+    // Connection failures move on to the next upstream, and a pooled
+    // connection that turns out to be closed is retried on a fresh one
+    int result = EXCHANGE_FAILED;
+    for (int attempt = 0; attempt <= num_upstreams; attempt++) {
+        upstream_t* upstream = pick_upstream();
+
+        int reused;
+        int fd = acquire_connection(upstream, &reused);
+        if (fd < 0) {
+            set_healthy(upstream, 0);
+            continue;
+        }
+
+        if (build_request(request, path, upstream, &buffer, &length) != 0) {
+            close(fd);
+            break;
+        }
+
+        int reusable;
+        result = exchange(fd, buffer.data, length, head_request, response,
+                          &reusable);
+        buffer_pool_release(&buffer);
+
+        if (result == EXCHANGE_OK) {
+            release_connection(upstream, fd, reusable);
+            return;
+        }
+        close(fd);
+
+        if (result != EXCHANGE_RETRY || !reused)
+            break;
+    }
+
+    set_error(response, result == EXCHANGE_TIMEOUT ? 504 : 502);
+}
@@ -0,0 +1,31 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "request.h"
+#include "response.h"
+
+/**
+ * Resolve the upstream servers and start health checking them
+ * @param upstreams Upstream addresses as "host:port"
+ * @param count Number of upstreams
+ * @return 0 on success, non-zero on error
+ */
+int proxy_init(const char* const* upstreams, int count);
+
+/**
+ * Check whether any upstream servers are configured
+ * @return 1 if the proxy is enabled, 0 otherwise
+ */
+int proxy_enabled(void);
+
+/**
+ * Forward a request to the next healthy upstream and fill the response
+ * with its answer
+ * @param request The HTTP request from the client
+ * @param path Path to request from the upstream, including the query
+ * @param response The HTTP response to fill
+ */
+void proxy_forward(const http_request_t* request, const char* path,
+                   http_response_t* response);
+
+#endif /* PROXY_H */
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include "rate_limit.h"
+
+#include <stdatomic.h>
+#include <time.h>
+
+#define PROBE_LIMIT 8         // Slots searched before evicting
+#define TOKEN_SCALE 1000      // Tokens are kept in thousandths
+#define TOKEN_BITS 24         // Low bits of the state hold the tokens
+#define TOKEN_MASK ((1ULL << TOKEN_BITS) - 1)
+#define MAX_BURST (TOKEN_MASK / TOKEN_SCALE)
+
+// One bucket. The key identifies the client (and route) and is never 0 for
+// a used slot. The state packs the time of the last refill in milliseconds
+// above the remaining tokens, so a bucket is updated with a single
+// compare-and-swap. A state of 0 means a full bucket.
+typedef struct {
+    atomic_ullong key;
+    atomic_ullong state;
+} bucket_t;
+
+typedef struct {
+    uint64_t tokens_per_ms;  // Refill rate, in thousandths (0 = no limit)
+    uint64_t max_tokens;
+} limit_t;
+
+static bucket_t buckets[RATE_LIMIT_TABLE_SIZE];
+static limit_t client_limit;
+static limit_t route_limit;
+static uint64_t start_ms = 0;
+
+// The coarse clock is read from the vDSO without a syscall
+static uint64_t clock_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Milliseconds since rate_limit_init(), never 0
+static uint64_t now_ms(void) {
+    return clock_ms() - start_ms + 1;
+}
+
+static void set_limit(limit_t* limit, int rate, int burst) {
+    if (rate <= 0)
+        return;
+    if (burst <= 0)
+        burst = rate;
+    if ((uint64_t)burst > MAX_BURST)
+        burst = MAX_BURST;
+
+    limit->tokens_per_ms = rate;  // rate * TOKEN_SCALE per 1000 ms
+    limit->max_tokens    = (uint64_t)burst * TOKEN_SCALE;
+}
+
+void rate_limit_init(int rate, int burst, int route_rate) {
+    start_ms = clock_ms();
+    set_limit(&client_limit, rate, burst);
+    set_limit(&route_limit, route_rate, route_rate);
+}
+
+// FNV-1a, folded to the 31 bits a key has room for
+static uint32_t hash_route(const char* route, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)route[i];
+        hash *= 16777619u;
+    }
+    return hash & 0x7fffffff;
+}
+
+// Final mixing step of splitmix64, spreads keys over the table
+static uint64_t mix(uint64_t key) {
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+// Find the bucket for a key, claiming an empty slot or evicting the least
+// recently used bucket in the probe window when it is not present. Losing
+// a race for a slot means the window changed, so the probe starts over.
+static bucket_t* find_bucket(uint64_t key) {
+    size_t index = mix(key) & (RATE_LIMIT_TABLE_SIZE - 1);
+
+    for (;;) {
+        bucket_t* oldest          = NULL;
+        uint64_t oldest_ms        = UINT64_MAX;
+        unsigned long long victim = 0;
+
+        for (int i = 0; i < PROBE_LIMIT; i++) {
+            bucket_t* bucket =
+                &buckets[(index + i) & (RATE_LIMIT_TABLE_SIZE - 1)];
+            unsigned long long current =
+                atomic_load_explicit(&bucket->key, memory_order_acquire);
+
+            if (current == key)
+                return bucket;
+            if (current == 0) {
+                if (atomic_compare_exchange_strong(&bucket->key, &current,
+                                                   key))
+                    return bucket;
+                if (current == key)
+                    return bucket;  // Another thread claimed it for us
+                continue;
+            }
+
+            uint64_t last_ms =
+                atomic_load_explicit(&bucket->state, memory_order_relaxed) >>
+                TOKEN_BITS;
+            if (last_ms < oldest_ms) {
+                oldest    = bucket;
+                oldest_ms = last_ms;
+                victim    = current;
+            }
+        }
+
+        // Evict. The evicted client starts over with a full bucket if it
+        // comes back, which only loses anything if it was limited recently.
+        if (oldest &&
+            atomic_compare_exchange_strong(&oldest->key, &victim, key)) {
+            atomic_store_explicit(&oldest->state, 0, memory_order_release);
+            return oldest;
+        }
+        if (oldest && victim == key)
+            return oldest;  // Another thread inserted the same key
+    }
+}
+
+int rate_limit_allow(uint32_t address, const char* route,
+                     size_t route_length) {
+    const limit_t* limit = route ? &route_limit : &client_limit;
+    if (!limit->tokens_per_ms)
+        return 1;
+
+    // Address in the high half, route in the low half. The top bit of the
+    // low half is always set so no key is 0.
+    uint64_t key = (uint64_t)address << 32 | 0x80000000u;
+    if (route)
+        key |= hash_route(route, route_length);
+
+    bucket_t* bucket = find_bucket(key);
+    uint64_t now     = now_ms();
+
+    unsigned long long state =
+        atomic_load_explicit(&bucket->state, memory_order_acquire);
+    for (;;) {
+        uint64_t tokens = limit->max_tokens;
+        uint64_t refill = now;
+        if (state != 0) {
+            uint64_t last_ms = state >> TOKEN_BITS;
+            tokens           = state & TOKEN_MASK;
+            if (now > last_ms)
+                tokens += (now - last_ms) * limit->tokens_per_ms;
+            else
+                refill = last_ms;  // Another thread read the clock later
+            if (tokens > limit->max_tokens)
+                tokens = limit->max_tokens;
+        }
+
+        // Denied requests still store the refilled state, which keeps the
+        // timestamp fresh for eviction
+        int allowed = tokens >= TOKEN_SCALE;
+        if (allowed)
+            tokens -= TOKEN_SCALE;
+
+        uint64_t next = refill << TOKEN_BITS | tokens;
+        if (next == state ||
+            atomic_compare_exchange_weak_explicit(&bucket->state, &state, next,
+                                                  memory_order_acq_rel,
+                                                  memory_order_acquire))
+            return allowed;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RATE_LIMIT_TABLE_SIZE 65536  // Buckets tracked at once (power of 2)
+
+/**
+ * Set up token-bucket rate limits
+ * @param rate Requests per second each client may make (0 = no limit)
+ * @param burst Requests a client may make at once after being idle
+ * @param route_rate Requests per second each client may make to each route,
+ *                   which is also the route burst (0 = no limit)
+ */
+void rate_limit_init(int rate, int burst, int route_rate);
+
+/**
+ * Take a token from the bucket of a client, or of a client and route.
+ * The server calls this once per connection: the client check when it
+ * accepts, the route check on the first request. An HTTP/1 connection
+ * carries one request, but the streams of an HTTP/2 connection are not
+ * checked one by one.
+ * @param address Client IPv4 address in network byte order
+ * @param route Route prefix the request is for (e.g. "/static/"), or NULL
+ *              for the client's overall bucket
+ * @param route_length Length of the route prefix
+ * @return 1 if the request may proceed, 0 if it is over the limit
+ */
+int rate_limit_allow(uint32_t address, const char* route, size_t route_length);
+
+#endif /* RATE_LIMIT_H */
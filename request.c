@@ -1,60 +1,100 @@
 #include "request.h"
 
-#include <ctype.h>
-#include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+
+#include "scan.h"
+
+// Copy the next space-delimited token of the request line. Returns the
+// position after it, or NULL if it is empty or does not fit.
+static const char* copy_token(const char* p, const char* end, char* dest,
+                              size_t dest_size) {
+    while (p < end && *p == ' ')
+        p++;
+    const char* token = p;
+    while (p < end && *p != ' ')
+        p++;
+
+    size_t length = p - token;
+    if (length == 0 || length >= dest_size)
+        return NULL;
+    memcpy(dest, token, length);
+    dest[length] = '\0';
+    return p;
+}
+
+static int is_ows(char c) { return c == ' ' || c == '\t'; }
 
 int parse_request(const char* buffer, http_request_t* request) {
     if (!buffer || !request)
         return -1;
 
-    memset(request, 0, sizeof(http_request_t));
+    // Only the fields below are written; num_headers says how many headers
+    // are valid
+    request->num_headers = 0;
 
-    char* buffer_copy = strdup(buffer);
-    if (!buffer_copy)
-        return -1;
+    const char* p   = buffer;
+    const char* end = buffer + strlen(buffer);
+    while (p < end && (*p == '\r' || *p == '\n'))
+        p++;
 
-    char* line = strtok(buffer_copy, "\r\n");
-    if (!line) {
-        free(buffer_copy);
+    scan_line_t line;
+    scan_line(p, end - p, &line);
+    if (line.invalid)
         return -1;
-    }
 
-    if (sscanf(line, "%15s %2047s %15s", request->method, request->path,
-               request->http_version) != 3) {
-        free(buffer_copy);
+    const char* line_end = p + line.length;
+    const char* q = copy_token(p, line_end, request->method,
+                               sizeof(request->method));
+    if (q)
+        q = copy_token(q, line_end, request->path, sizeof(request->path));
+    if (q)
+        q = copy_token(q, line_end, request->http_version,
+                       sizeof(request->http_version));
+    if (!q)
         return -1;
-    }
 
-    request->num_headers = 0;
-    while ((line = strtok(NULL, "\r\n")) != NULL && *line) {
+    for (;;) {
+        // Step over the CRLF (or bare LF) ending the previous line
+        p = line_end;
+        if (p < end && *p == '\r')
+            p++;
+        if (p < end && *p == '\n')
+            p++;
+        if (p >= end || *p == '\r' || *p == '\n')
+            break;  // Blank line: end of the head
+
+        scan_line(p, end - p, &line);
+        if (line.invalid)
+            return -1;
+        line_end = p + line.length;
+
+        if (line.colon == SCAN_NO_COLON)
+            continue;  // Invalid header line
         if (request->num_headers >= MAX_HEADERS)
             break;
 
-        char* colon = strchr(line, ':');
-        if (!colon)
-            continue;  // Invalid header line
+        http_header_t* header = &request->headers[request->num_headers++];
 
-        size_t name_len = colon - line;
-        if (name_len >= MAX_HEADER_NAME_LENGTH)
-            name_len = MAX_HEADER_NAME_LENGTH - 1;
-        strncpy(request->headers[request->num_headers].name, line, name_len);
-        request->headers[request->num_headers].name[name_len] = '\0';
+        size_t name_length = line.colon;
+        if (name_length >= MAX_HEADER_NAME_LENGTH)
+            name_length = MAX_HEADER_NAME_LENGTH - 1;
+        header->name_hash = scan_copy_name(header->name, p, name_length);
 
-        const char* value                                     = colon + 1;
-        while (*value && isspace(*value))
+        const char* value = p + line.colon + 1;
+        while (value < line_end && is_ows(*value))
             value++;
-
-        strncpy(request->headers[request->num_headers].value, value,
-                MAX_HEADER_VALUE_LENGTH - 1);
-        request->headers[request->num_headers]
-            .value[MAX_HEADER_VALUE_LENGTH - 1] = '\0';
-
-        request->num_headers++;
+        const char* value_end = line_end;
+        while (value_end > value && is_ows(value_end[-1]))
+            value_end--;
+
+        size_t value_length = value_end - value;
+        if (value_length >= MAX_HEADER_VALUE_LENGTH)
+            value_length = MAX_HEADER_VALUE_LENGTH - 1;
+        memcpy(header->value, value, value_length);
+        header->value[value_length] = '\0';
     }
 
-    free(buffer_copy);
     return 0;
 }
 
@@ -62,8 +102,10 @@ const char* get_header_value(const http_request_t* request, const char* name) {
     if (!request || !name)
         return NULL;
 
+    uint32_t hash = scan_hash_name(name);
     for (int i = 0; i < request->num_headers; i++)
-        if (strcasecmp(request->headers[i].name, name) == 0)
+        if (request->headers[i].name_hash == hash &&
+            strcasecmp(request->headers[i].name, name) == 0)
             return request->headers[i].value;
 
     return NULL;
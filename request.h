@@ -1,6 +1,8 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+#include <stdint.h>
+
 #define MAX_PATH_LENGTH 2048
 #define MAX_HEADERS 50
 #define MAX_HEADER_NAME_LENGTH 128
@@ -9,6 +11,7 @@
 typedef struct {
     char name[MAX_HEADER_NAME_LENGTH];
     char value[MAX_HEADER_VALUE_LENGTH];
+    uint32_t name_hash;  // scan_hash_name() of name
 } http_header_t;
 
 typedef struct {
@@ -17,6 +20,7 @@ typedef struct {
     char http_version[16];
     http_header_t headers[MAX_HEADERS];
     int num_headers;
+    int local_peer;  // Set by the server, not parsed: see connection_is_local()
 } http_request_t;
 
 /**
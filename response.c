@@ -1,9 +1,12 @@
 #include "response.h"
 
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #define INITIAL_HEADER_CAPACITY 10
 
@@ -18,6 +21,8 @@ void init_response(http_response_t* response) {
     response->content_type   = "text/plain";
     response->content        = NULL;
     response->content_length = 0;
+    response->file_fd        = -1;
+    response->file_offset    = 0;
 
     response->max_headers    = INITIAL_HEADER_CAPACITY;
     response->header_names   = calloc(response->max_headers, sizeof(char*));
@@ -41,10 +46,16 @@ void free_response(http_response_t* response) {
         return;
 
     if (response->content) {
-        free(response->content);
+        if (!response->content_borrowed)
+            free(response->content);
         response->content = NULL;
     }
 
+    if (response->file_fd >= 0) {
+        close(response->file_fd);
+        response->file_fd = -1;
+    }
+
     if (response->header_names) {
         for (int i = 0; i < response->num_headers; i++)
             if (response->header_names[i])
@@ -87,8 +98,14 @@ void set_response_content(http_response_t* response, const void* content,
     if (!response)
         return;
 
-    if (response->content)
+    if (response->content && !response->content_borrowed)
         free(response->content);
+    response->content_borrowed = 0;
+
+    if (response->file_fd >= 0) {
+        close(response->file_fd);
+        response->file_fd = -1;
+    }
 
     if (content && length > 0) {
         response->content = malloc(length);
@@ -105,8 +122,43 @@ void set_response_content(http_response_t* response, const void* content,
     }
 }
 
-int add_response_header(http_response_t* response, const char* name,
-                        const char* value) {
+void set_response_content_ref(http_response_t* response, const void* content,
+                              size_t length) {
+    if (!response)
+        return;
+
+    set_response_content(response, NULL, 0);
+
+    response->content          = (char*)content;
+    response->content_length   = length;
+    response->content_borrowed = 1;
+}
+
+void set_response_content_owned(http_response_t* response, char* content,
+                                size_t length) {
+    if (!response)
+        return;
+
+    set_response_content(response, NULL, 0);
+
+    response->content        = content;
+    response->content_length = content ? length : 0;
+}
+
+void set_response_file(http_response_t* response, int fd, off_t offset,
+                       size_t length) {
+    if (!response || fd < 0)
+        return;
+
+    set_response_content(response, NULL, 0);
+
+    response->file_fd        = fd;
+    response->file_offset    = offset;
+    response->content_length = length;
+}
+
+static int insert_header(http_response_t* response, const char* name,
+                         const char* value, int replace) {
     if (!response || !name || !value)
         return -1;
 
@@ -130,7 +182,7 @@ int add_response_header(http_response_t* response, const char* name,
         response->max_headers   = new_size;
     }
 
-    for (int i = 0; i < response->num_headers; i++) {
+    for (int i = 0; replace && i < response->num_headers; i++) {
         if (strcasecmp(response->header_names[i], name) == 0) {
             free(response->header_values[i]);
             response->header_values[i] = strdup(value);
@@ -145,13 +197,43 @@ int add_response_header(http_response_t* response, const char* name,
     return 0;
 }
 
-int format_response(const http_response_t* response, char* buffer,
-                    size_t buffer_size) {
-    if (!response || !buffer || buffer_size == 0)
+int add_response_header(http_response_t* response, const char* name,
+                        const char* value) {
+    return insert_header(response, name, value, 1);
+}
+
+int append_response_header(http_response_t* response, const char* name,
+                           const char* value) {
+    return insert_header(response, name, value, 0);
+}
+
+// Append to a header block, writing only what still fits in the buffer.
+// The offset always advances by the full length, so it ends up as the size
+// the whole block needs.
+static void append_format(char* buffer, size_t buffer_size, size_t* offset,
+                          const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length;
+    if (*offset < buffer_size)
+        length = vsnprintf(buffer + *offset, buffer_size - *offset, format,
+                           args);
+    else
+        length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (length > 0)
+        *offset += length;
+}
+
+int format_response_headers(const http_response_t* response, char* buffer,
+                            size_t buffer_size) {
+    if (!response || (!buffer && buffer_size > 0))
         return -1;
 
-    int offset             = snprintf(buffer, buffer_size, "HTTP/1.1 %d %s\r\n",
-                                      response->status_code, response->status_text);
+    size_t offset = 0;
+    append_format(buffer, buffer_size, &offset, "HTTP/1.1 %d %s\r\n",
+                  response->status_code, response->status_text);
 
     int content_type_found = 0;
     for (int i = 0; i < response->num_headers; i++) {
@@ -162,8 +244,8 @@ int format_response(const http_response_t* response, char* buffer,
     }
 
     if (!content_type_found && response->content_type) {
-        offset += snprintf(buffer + offset, buffer_size - offset,
-                           "Content-Type: %s\r\n", response->content_type);
+        append_format(buffer, buffer_size, &offset, "Content-Type: %s\r\n",
+                      response->content_type);
     }
 
     int content_length_found = 0;
@@ -175,17 +257,25 @@ int format_response(const http_response_t* response, char* buffer,
     }
 
     if (!content_length_found) {
-        offset += snprintf(buffer + offset, buffer_size - offset,
-                           "Content-Length: %zu\r\n", response->content_length);
+        append_format(buffer, buffer_size, &offset, "Content-Length: %zu\r\n",
+                      response->content_length);
     }
 
     for (int i = 0; i < response->num_headers; i++) {
-        offset +=
-            snprintf(buffer + offset, buffer_size - offset, "%s: %s\r\n",
-                     response->header_names[i], response->header_values[i]);
+        append_format(buffer, buffer_size, &offset, "%s: %s\r\n",
+                      response->header_names[i], response->header_values[i]);
     }
 
-    offset += snprintf(buffer + offset, buffer_size - offset, "\r\n");
+    append_format(buffer, buffer_size, &offset, "\r\n");
+
+    return offset > INT_MAX ? -1 : (int)offset;
+}
+
+int format_response(const http_response_t* response, char* buffer,
+                    size_t buffer_size) {
+    int offset = format_response_headers(response, buffer, buffer_size);
+    if (offset < 0 || (size_t)offset >= buffer_size)
+        return -1;
 
     if (offset + response->content_length > buffer_size)
         return -1;
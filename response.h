@@ -2,6 +2,7 @@
 #define RESPONSE_H
 
 #include <stddef.h>
+#include <sys/types.h>
 
 typedef struct {
     int status_code;
@@ -9,6 +10,11 @@ typedef struct {
     const char* content_type;
     char* content;
     size_t content_length;
+    int content_borrowed;  // content is not owned by the response
+
+    // File body sent with sendfile() instead of content (-1 if unused)
+    int file_fd;
+    off_t file_offset;
 
     // Headers
     char** header_names;
@@ -54,6 +60,36 @@ void set_response_content_type(http_response_t* response,
 void set_response_content(http_response_t* response, const void* content,
                           size_t length);
 
+/**
+ * Use memory that outlives the response as its content, without copying
+ * @param response Pointer to the response structure
+ * @param content Content data
+ * @param length Length of the content in bytes
+ */
+void set_response_content_ref(http_response_t* response, const void* content,
+                              size_t length);
+
+/**
+ * Use a malloc()ed buffer as the content, without copying. The response
+ * takes ownership of the buffer and frees it.
+ * @param response Pointer to the response structure
+ * @param content Content data
+ * @param length Length of the content in bytes
+ */
+void set_response_content_owned(http_response_t* response, char* content,
+                                size_t length);
+
+/**
+ * Use an open file as the response body. The response takes ownership of
+ * the descriptor and closes it in free_response().
+ * @param response Pointer to the response structure
+ * @param fd Open file descriptor
+ * @param offset Offset of the body within the file
+ * @param length Length of the body in bytes
+ */
+void set_response_file(http_response_t* response, int fd, off_t offset,
+                       size_t length);
+
 /**
  * Add a header to the response
  * @param response Pointer to the response structure
@@ -64,6 +100,30 @@ void set_response_content(http_response_t* response, const void* content,
 int add_response_header(http_response_t* response, const char* name,
                         const char* value);
 
+/**
+ * Add a header to the response, keeping any earlier ones with the same
+ * name (for headers that may repeat, such as Set-Cookie)
+ * @param response Pointer to the response structure
+ * @param name Header name
+ * @param value Header value
+ * @return 0 on success, non-zero on error
+ */
+int append_response_header(http_response_t* response, const char* name,
+                           const char* value);
+
+/**
+ * Format the status line and headers (without the body) into a buffer.
+ * Like snprintf(), nothing is written past buffer_size and the full length
+ * is returned, so a result >= buffer_size means the block was cut short.
+ * @param response Pointer to the response structure
+ * @param buffer Buffer to write the formatted headers to (may be NULL when
+ *               buffer_size is 0)
+ * @param buffer_size Size of the buffer
+ * @return Length of the whole header block, or -1 on error
+ */
+int format_response_headers(const http_response_t* response, char* buffer,
+                            size_t buffer_size);
+
 /**
  * Format the response into a buffer for sending
  * @param response Pointer to the response structure
@@ -9,8 +9,104 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "asset_pack.h"
+#include "cache.h"
+#include "coroutine.h"
+#include "expr.h"
+#include "proxy.h"
+#include "trace.h"
 #include "utils.h"
 
+static void dispatch_request(const http_request_t* request,
+                             http_response_t* response) {
+    if (strncmp(request->path, "/static/", 8) == 0) {
+        handle_static_request(request, response);
+    } else if (strncmp(request->path, "/calc/", 6) == 0) {
+        handle_calc_request(request, response);
+    } else if (strncmp(request->path, "/sleep/", 7) == 0) {
+        handle_sleep_request(request, response);
+    } else if (strncmp(request->path, "/proxy/", 7) == 0 && proxy_enabled()) {
+        handle_proxy_request(request, response);
+    } else if (strncmp(request->path, "/admin/", 7) == 0) {
+        handle_admin_request(request, response);
+    } else {
+        // Handle 404 Not Found
+        set_response_status(response, 404, "Not Found");
+        set_response_content_type(response, "text/plain");
+        set_response_content(response, "404 Not Found", 13);
+    }
+}
+
+void route_request(const http_request_t* request, http_response_t* response) {
+    // Server introspection is only for clients on this machine. Checked
+    // here so that a cached admin response is never served to others.
+    if (strncmp(request->path, "/admin/", 7) == 0 && !request->local_peer) {
+        set_response_status(response, 403, "Forbidden");
+        set_response_content_type(response, "text/plain");
+        set_response_content(response, "403 Forbidden", 13);
+        return;
+    }
+
+    // Routes opted into the micro-cache skip the handler while fresh
+    int ttl_ms = strcmp(request->method, "GET") == 0
+                     ? cache_route_ttl(request->path)
+                     : 0;
+    if (ttl_ms > 0)
+        cache_serve(request, response, ttl_ms, dispatch_request);
+    else
+        dispatch_request(request, response);
+}
+
+// Serve a static file from the memory-mapped asset pack. The content is
+// sent straight from the mapping, with no per-request syscalls.
+static void handle_packed_request(const http_request_t* request,
+                                  http_response_t* response,
+                                  const char* file_path) {
+    asset_t asset;
+    if (asset_pack_find(file_path, &asset) != 0) {
+        set_response_status(response, 404, "Not Found");
+        set_response_content_type(response, "text/plain");
+        const char* error_msg = "File not found";
+        set_response_content(response, error_msg, strlen(error_msg));
+        return;
+    }
+
+    const char* data = asset.data;
+    size_t length    = asset.length;
+    char etag[64];
+    snprintf(etag, sizeof(etag), "%s", asset.etag);
+
+    if (asset.gzip_length > 0) {
+        add_response_header(response, "Vary", "Accept-Encoding");
+
+        const char* accept_encoding =
+            get_header_value(request, "Accept-Encoding");
+        if (accept_encoding && strstr(accept_encoding, "gzip")) {
+            data   = asset.gzip_data;
+            length = asset.gzip_length;
+            // Variants need their own tag: "<hash>-gz"
+            snprintf(etag, sizeof(etag), "%.*s-gz\"",
+                     (int)strlen(asset.etag) - 1, asset.etag);
+            add_response_header(response, "Content-Encoding", "gzip");
+        }
+    }
+
+    add_response_header(response, "ETag", etag);
+    set_response_content_type(response, asset.mime_type);
+
+    const char* if_none_match = get_header_value(request, "If-None-Match");
+    if (if_none_match && strcmp(if_none_match, etag) == 0) {
+        char length_str[32];
+        snprintf(length_str, sizeof(length_str), "%zu", length);
+        add_response_header(response, "Content-Length", length_str);
+        set_response_status(response, 304, "Not Modified");
+        return;
+    }
+
+    set_response_content_ref(response, data, length);
+    set_response_status(response, 200, "OK");
+}
+
 void handle_static_request(const http_request_t* request,
                            http_response_t* response) {
     if (strcmp(request->method, "GET") != 0) {
@@ -23,10 +119,15 @@ void handle_static_request(const http_request_t* request,
 
     const char* file_path = request->path + 7;  // Skip "/static/"
 
+    if (asset_pack_loaded()) {
+        handle_packed_request(request, response, file_path + 1);
+        return;
+    }
+
     char full_path[PATH_MAX];
     snprintf(full_path, sizeof(full_path), "static/%s", file_path);
 
-    int fd = open(full_path, O_RDONLY);
+    int fd = open(full_path, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
         set_response_status(response, 404, "Not Found");
         set_response_content_type(response, "text/plain");
@@ -45,24 +146,11 @@ void handle_static_request(const http_request_t* request,
         return;
     }
 
-    char* file_content = malloc(st.st_size);
-    if (!file_content) {
+    if (!S_ISREG(st.st_mode)) {
         close(fd);
-        set_response_status(response, 500, "Internal Server Error");
-        set_response_content_type(response, "text/plain");
-        const char* error_msg = "Out of memory";
-        set_response_content(response, error_msg, strlen(error_msg));
-        return;
-    }
-
-    ssize_t bytes_read = read(fd, file_content, st.st_size);
-    close(fd);
-
-    if (bytes_read != st.st_size) {
-        free(file_content);
-        set_response_status(response, 500, "Internal Server Error");
+        set_response_status(response, 404, "Not Found");
         set_response_content_type(response, "text/plain");
-        const char* error_msg = "Failed to read file";
+        const char* error_msg = "File not found";
         set_response_content(response, error_msg, strlen(error_msg));
         return;
     }
@@ -70,12 +158,49 @@ void handle_static_request(const http_request_t* request,
     const char* content_type = get_mime_type(full_path);
     set_response_content_type(response, content_type);
 
-    set_response_content(response, file_content, st.st_size);
-    free(file_content);
+    // The body is sent straight from the file with sendfile()
+    set_response_file(response, fd, 0, st.st_size);
 
     set_response_status(response, 200, "OK");
 }
 
+// Evaluate /calc/expr/<url-encoded expression>, e.g. /calc/expr/2*(3%2B4)
+static void handle_expr_request(const http_request_t* request,
+                                http_response_t* response) {
+    char expression[EXPR_MAX_LENGTH + 1];
+    char error_msg[128];
+    double result;
+
+    if (url_decode(request->path + 11, expression, sizeof(expression)) != 0) {
+        snprintf(error_msg, sizeof(error_msg), "Invalid expression encoding");
+    } else if (expr_evaluate(expression, &result, error_msg,
+                             sizeof(error_msg)) == 0) {
+        // The expression only contains characters that are safe in HTML
+        char html[EXPR_MAX_LENGTH + 512];
+        int html_len = snprintf(html, sizeof(html),
+                                "<!DOCTYPE html>\n"
+                                "<html>\n"
+                                "<head>\n"
+                                "    <title>Calculation Result</title>\n"
+                                "</head>\n"
+                                "<body>\n"
+                                "    <h1>Expression Result</h1>\n"
+                                "    <p>%s = %.15g</p>\n"
+                                "</body>\n"
+                                "</html>",
+                                expression, result);
+
+        set_response_status(response, 200, "OK");
+        set_response_content_type(response, "text/html");
+        set_response_content(response, html, html_len);
+        return;
+    }
+
+    set_response_status(response, 400, "Bad Request");
+    set_response_content_type(response, "text/plain");
+    set_response_content(response, error_msg, strlen(error_msg));
+}
+
 void handle_calc_request(const http_request_t* request,
                          http_response_t* response) {
     if (strcmp(request->method, "GET") != 0) {
@@ -86,6 +211,11 @@ void handle_calc_request(const http_request_t* request,
         return;
     }
 
+    if (strncmp(request->path, "/calc/expr/", 11) == 0) {
+        handle_expr_request(request, response);
+        return;
+    }
+
     char path_copy[MAX_PATH_LENGTH];
     strncpy(path_copy, request->path, sizeof(path_copy) - 1);
     path_copy[sizeof(path_copy) - 1] = '\0';
@@ -212,7 +342,7 @@ void handle_sleep_request(const http_request_t* request,
         return;
     }
 
-    sleep(seconds);
+    co_sleep(seconds);
 
     char html[1024];
     int html_len = snprintf(html, sizeof(html),
@@ -232,3 +362,85 @@ void handle_sleep_request(const http_request_t* request,
     set_response_content_type(response, "text/html");
     set_response_content(response, html, html_len);
 }
+
+void handle_proxy_request(const http_request_t* request,
+                          http_response_t* response) {
+    // Request bodies are never read, so only methods without one can be
+    // forwarded
+    if (strcmp(request->method, "GET") != 0 &&
+        strcmp(request->method, "HEAD") != 0) {
+        set_response_status(response, 405, "Method Not Allowed");
+        add_response_header(response, "Allow", "GET, HEAD");
+        set_response_content_type(response, "text/plain");
+        set_response_content(response, "Method Not Allowed", 18);
+        return;
+    }
+
+    // "/proxy/users?id=1" is forwarded as "/users?id=1"
+    proxy_forward(request, request->path + 6, response);
+}
+
+// Export the sampled request traces as Chrome trace-event JSON, which can be
+// loaded in chrome://tracing or Perfetto
+static void handle_trace_request(http_response_t* response) {
+    char* trace   = NULL;
+    size_t length = 0;
+    FILE* out     = open_memstream(&trace, &length);
+    if (!out) {
+        set_response_status(response, 500, "Internal Server Error");
+        set_response_content_type(response, "text/plain");
+        set_response_content(response, "500 Internal Server Error", 25);
+        return;
+    }
+    trace_dump(out);
+    fclose(out);
+
+    set_response_status(response, 200, "OK");
+    set_response_content_type(response, "application/json");
+    set_response_content_owned(response, trace, length);
+}
+
+// Report the micro-cache counters as JSON
+static void handle_cache_stats_request(http_response_t* response) {
+    cache_stats_t stats;
+    cache_get_stats(&stats);
+
+    unsigned long lookups = stats.hits + stats.coalesced + stats.misses;
+    double hit_ratio      = lookups ? (double)(stats.hits + stats.coalesced) /
+                                          lookups
+                                    : 0.0;
+
+    char body[512];
+    int length = snprintf(
+        body, sizeof(body),
+        "{\"hits\":%lu,\"coalesced\":%lu,\"misses\":%lu,"
+        "\"hit_ratio\":%.4f,\"evictions\":%lu,\"bypassed\":%lu,"
+        "\"entries\":%lu,\"bytes\":%lu}\n",
+        stats.hits, stats.coalesced, stats.misses, hit_ratio, stats.evictions,
+        stats.bypassed, stats.entries, stats.bytes);
+
+    set_response_status(response, 200, "OK");
+    set_response_content_type(response, "application/json");
+    set_response_content(response, body, length);
+}
+
+void handle_admin_request(const http_request_t* request,
+                          http_response_t* response) {
+    if (strcmp(request->method, "GET") != 0) {
+        set_response_status(response, 405, "Method Not Allowed");
+        add_response_header(response, "Allow", "GET");
+        set_response_content_type(response, "text/plain");
+        set_response_content(response, "Method Not Allowed", 18);
+        return;
+    }
+
+    if (strcmp(request->path, "/admin/trace") == 0 && trace_enabled()) {
+        handle_trace_request(response);
+    } else if (strcmp(request->path, "/admin/cache") == 0) {
+        handle_cache_stats_request(response);
+    } else {
+        set_response_status(response, 404, "Not Found");
+        set_response_content_type(response, "text/plain");
+        set_response_content(response, "404 Not Found", 13);
+    }
+}
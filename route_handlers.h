@@ -4,6 +4,13 @@
 #include "request.h"
 #include "response.h"
 
+/**
+ * Dispatch a request to the handler for its path
+ * @param request The HTTP request
+ * @param response The HTTP response to fill
+ */
+void route_request(const http_request_t* request, http_response_t* response);
+
 /**
  * Handle a request to the /static/ path
  * @param request The HTTP request
@@ -27,4 +34,20 @@ void handle_calc_request(const http_request_t* request,
  */
 void handle_sleep_request(const http_request_t* request,
                           http_response_t* response);
+
+/**
+ * Handle a request to the /proxy/ path, forwarded to the upstream servers
+ * @param request The HTTP request
+ * @param response The HTTP response to fill
+ */
+void handle_proxy_request(const http_request_t* request,
+                          http_response_t* response);
+
+/**
+ * Handle a request to the /admin/ path (server introspection)
+ * @param request The HTTP request
+ * @param response The HTTP response to fill
+ */
+void handle_admin_request(const http_request_t* request,
+                          http_response_t* response);
 #endif /* ROUTE_HANDLERS_H */
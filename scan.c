@@ -0,0 +1,156 @@
+#include "scan.h"
+
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+// Find the first byte scan_line() has to look at, or return length
+typedef size_t (*find_special_fn)(const char* data, size_t length);
+
+// Control characters other than tab (which includes CR and LF), DEL and ':'
+static const unsigned char special[256] = {
+    [0 ... 8] = 1, [10 ... 31] = 1, [':'] = 1, [127] = 1};
+
+static size_t find_special_scalar(const char* data, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < length; i++)
+        if (special[bytes[i]])
+            return i;
+    return length;
+}
+
+#ifdef HAVE_X86_KERNELS
+// PCMPESTRI matches 16 bytes against up to 8 byte ranges at once
+__attribute__((target("sse4.2"))) static size_t find_special_sse42(
+    const char* data, size_t length) {
+    static const char ranges[16] = "\x00\x08\x0a\x1f::\x7f\x7f";
+    const __m128i set            = _mm_loadu_si128((const __m128i*)ranges);
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+        int index     = _mm_cmpestri(
+            set, 8, block, 16,
+            _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16)
+            return i + index;
+    }
+    return i + find_special_scalar(data + i, length - i);
+}
+
+// Compares 32 bytes against each class of special byte and combines the
+// results into one bit mask
+__attribute__((target("avx2"))) static size_t find_special_avx2(
+    const char* data, size_t length) {
+    const __m256i control_max = _mm256_set1_epi8(0x1f);
+    const __m256i tab         = _mm256_set1_epi8('\t');
+    const __m256i colon       = _mm256_set1_epi8(':');
+    const __m256i del         = _mm256_set1_epi8(0x7f);
+
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+
+        // Unsigned byte <= 0x1f, except tab
+        __m256i control = _mm256_cmpeq_epi8(
+            _mm256_min_epu8(block, control_max), block);
+        control =
+            _mm256_andnot_si256(_mm256_cmpeq_epi8(block, tab), control);
+
+        __m256i found = _mm256_or_si256(
+            control, _mm256_or_si256(_mm256_cmpeq_epi8(block, colon),
+                                     _mm256_cmpeq_epi8(block, del)));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(found);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + find_special_scalar(data + i, length - i);
+}
+#endif
+
+static find_special_fn select_kernel(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return find_special_avx2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return find_special_sse42;
+#endif
+    return find_special_scalar;
+}
+
+// Picked on first use. Threads racing to pick it store the same value.
+static _Atomic(find_special_fn) kernel = NULL;
+
+static find_special_fn get_kernel(void) {
+    find_special_fn find_special =
+        atomic_load_explicit(&kernel, memory_order_relaxed);
+    if (!find_special) {
+        find_special = select_kernel();
+        atomic_store_explicit(&kernel, find_special, memory_order_relaxed);
+    }
+    return find_special;
+}
+
+void scan_line(const char* data, size_t length, scan_line_t* line) {
+    find_special_fn find_special = get_kernel();
+
+    line->colon   = SCAN_NO_COLON;
+    line->invalid = 0;
+
+    size_t i = 0;
+    for (;;) {
+        i += find_special(data + i, length - i);
+        if (i == length || data[i] == '\r' || data[i] == '\n')
+            break;
+
+        if (data[i] != ':')
+            line->invalid = 1;
+        else if (line->colon == SCAN_NO_COLON)
+            line->colon = i;
+        i++;
+    }
+
+    line->length = i;
+}
+
+static inline unsigned char fold(unsigned char c) {
+    return (unsigned)(c - 'A') < 26 ? c + ('a' - 'A') : c;
+}
+
+// FNV-1a over the lowercase name
+uint32_t scan_copy_name(char* dest, const char* name, size_t length) {
+    uint32_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = name[i];
+        dest[i]         = c;
+        hash            = (hash ^ fold(c)) * FNV_PRIME;
+    }
+    dest[length] = '\0';
+    return hash;
+}
+
+uint32_t scan_hash_name(const char* name) {
+    uint32_t hash = FNV_OFFSET;
+    for (const unsigned char* c = (const unsigned char*)name; *c; c++)
+        hash = (hash ^ fold(*c)) * FNV_PRIME;
+    return hash;
+}
+
+const char* scan_kernel_name(void) {
+    find_special_fn find_special = get_kernel();
+#ifdef HAVE_X86_KERNELS
+    if (find_special == find_special_avx2)
+        return "avx2";
+    if (find_special == find_special_sse42)
+        return "sse4.2";
+#endif
+    (void)find_special;
+    return "scalar";
+}
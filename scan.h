@@ -0,0 +1,48 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAN_NO_COLON SIZE_MAX
+
+// Layout of one line of a request head
+typedef struct {
+    size_t length;  // Bytes before the CR or LF ending the line
+    size_t colon;   // Offset of the first ':', or SCAN_NO_COLON
+    int invalid;    // The line contains a control character
+} scan_line_t;
+
+/**
+ * Scan one line of a request head, 16 or 32 bytes at a time when the CPU
+ * supports SSE4.2 or AVX2. The kernel is picked on first use.
+ * @param data Start of the line
+ * @param length Bytes available (the line ends at the first CR or LF, or
+ *               here if there is none)
+ * @param line Filled with the layout of the line
+ */
+void scan_line(const char* data, size_t length, scan_line_t* line);
+
+/**
+ * Copy a header name and hash it case-insensitively in the same pass
+ * @param dest Buffer to copy to (length + 1 bytes)
+ * @param name Header name (not null-terminated)
+ * @param length Length of the name
+ * @return Hash of the lowercase name
+ */
+uint32_t scan_copy_name(char* dest, const char* name, size_t length);
+
+/**
+ * Hash a header name case-insensitively, matching scan_copy_name()
+ * @param name Null-terminated header name
+ * @return Hash of the lowercase name
+ */
+uint32_t scan_hash_name(const char* name);
+
+/**
+ * Name of the kernel scan_line() uses
+ * @return "avx2", "sse4.2" or "scalar"
+ */
+const char* scan_kernel_name(void);
+
+#endif /* SCAN_H */
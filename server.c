@@ -1,115 +1,439 @@
+#define _GNU_SOURCE
 #include "server.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "asset_pack.h"
+#include "buffer_pool.h"
+#include "cache.h"
+#include "connection.h"
+#include "coroutine.h"
+#include "http2.h"
+#include "proxy.h"
+#include "rate_limit.h"
 #include "request.h"
 #include "response.h"
 #include "route_handlers.h"
+#include "tls.h"
+#include "trace.h"
 
-#define MAX_CONNECTIONS 100
-#define BUFFER_SIZE 8192
+#define DEFAULT_BACKLOG 100
+#define DEFAULT_MAX_HEADER_SIZE (64 * 1024)
+#define RESPONSE_HEADER_RESERVE 2048
+#define COALESCE_LIMIT 8192
+#define REQUEST_TOO_LARGE -2
+#define DEFAULT_TRACE_FILE "trace.json"
+#define DRAIN_SIZE 4096
+#define PEER_NAME_LENGTH 128
+#define MAX_LISTENERS 2
+
+// Sent as-is to clients over their rate limit
+static const char RATE_LIMITED_RESPONSE[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 21\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "429 Too Many Requests";
+
+// Socket file removed when the server is stopped, NULL until bound
+static const char* unix_socket_path = NULL;
+
+// Remove the Unix socket file, then let the signal stop the process as
+// it would have without the handler
+static void remove_unix_socket(int signal_number) {
+    unlink(unix_socket_path);
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
 
 // Structure to pass client information to thread
 typedef struct {
     int client_fd;
-    struct sockaddr_in client_addr;
+    struct sockaddr_storage client_addr;  // AF_INET, AF_INET6 or AF_UNIX
+    const server_config_t* config;
+    uint64_t accept_time;  // For tracing, 0 when tracing is off
+    int rate_limited;      // Answer with 429 once the TLS handshake is done
 } client_info_t;
 
+void init_server_config(server_config_t* config) {
+    if (!config)
+        return;
+
+    memset(config, 0, sizeof(server_config_t));
+
+    config->port            = 80;
+    config->backlog         = DEFAULT_BACKLOG;
+    config->max_header_size = DEFAULT_MAX_HEADER_SIZE;
+    config->trace_file      = DEFAULT_TRACE_FILE;
+    config->cache_size      = CACHE_DEFAULT_SIZE;
+}
+
+static void set_cork(int fd, int on) {
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// Send the headers and body of a response. With corking enabled the
+// headers and body leave in as few segments as possible.
+static void send_response(connection_t* conn, const http_response_t* response,
+                          const server_config_t* config,
+                          trace_context_t* trace) {
+    // Borrow room for the headers, plus the body when it is small enough to
+    // go out in the same write
+    int coalesce = response->file_fd < 0 && response->content &&
+                   response->content_length <= COALESCE_LIMIT;
+    size_t size  = RESPONSE_HEADER_RESERVE;
+    if (coalesce)
+        size += response->content_length;
+
+    pool_buffer_t buffer;
+    if (buffer_pool_acquire(&buffer, size) != 0)
+        return;
+
+    // Headers that did not fit are formatted again into a buffer sized
+    // from the length the first attempt reported
+    int header_size = format_response_headers(response, buffer.data,
+                                              buffer.size);
+    if (header_size >= 0 && (size_t)header_size >= buffer.size) {
+        size = header_size + 1 + (coalesce ? response->content_length : 0);
+        if (buffer_pool_grow(&buffer, 0, size) == 0)
+            header_size = format_response_headers(response, buffer.data,
+                                                  buffer.size);
+        else
+            header_size = -1;
+    }
+    if (header_size < 0 || (size_t)header_size >= buffer.size) {
+        buffer_pool_release(&buffer);
+        return;
+    }
+    char* response_buffer = buffer.data;
+    trace_mark(trace, TRACE_FORMATTED);
+
+    if (config->cork)
+        set_cork(conn->fd, 1);
+
+    if (response->file_fd >= 0) {
+        if (connection_send_all(conn, response_buffer, header_size, 0) == 0)
+            connection_send_file(conn, response->file_fd,
+                                 response->file_offset,
+                                 response->content_length);
+    } else if (coalesce &&
+               header_size + response->content_length <= buffer.size) {
+        // Small bodies go out in the same write as the headers
+        memcpy(response_buffer + header_size, response->content,
+               response->content_length);
+        connection_send_all(conn, response_buffer,
+                            header_size + response->content_length, 0);
+    } else {
+        if (connection_send_all(conn, response_buffer, header_size, 0) == 0 &&
+            response->content)
+            connection_send_all(conn, response->content,
+                                response->content_length, 0);
+    }
+
+    if (config->cork)
+        set_cork(conn->fd, 0);
+    trace_mark(trace, TRACE_SENT);
+
+    buffer_pool_release(&buffer);
+}
+
+static void send_error_response(connection_t* conn, int status_code,
+                                const char* status_text,
+                                const server_config_t* config,
+                                trace_context_t* trace) {
+    char message[128];
+    int length = snprintf(message, sizeof(message), "%d %s", status_code,
+                          status_text);
+
+    http_response_t response;
+    init_response(&response);
+    set_response_status(&response, status_code, status_text);
+    set_response_content_type(&response, "text/plain");
+    set_response_content(&response, message, length);
+
+    send_response(conn, &response, config, trace);
+
+    free_response(&response);
+}
+
+// Read until the end of the request headers, moving to a larger buffer
+// when they do not fit. Returns the number of bytes read, 0 if the client
+// closed the connection, -1 on error or REQUEST_TOO_LARGE.
+static ssize_t read_request(connection_t* conn, pool_buffer_t* buffer,
+                            size_t max_size, trace_context_t* trace) {
+    size_t used = 0;
+
+    for (;;) {
+        if (used >= max_size)
+            return REQUEST_TOO_LARGE;
+
+        // Keep one byte for the terminator
+        if (used + 1 >= buffer->size &&
+            buffer_pool_grow(buffer, used, buffer->size * 2) != 0)
+            return REQUEST_TOO_LARGE;
+
+        ssize_t bytes = connection_recv(conn, buffer->data + used,
+                                        buffer->size - used - 1);
+        if (bytes <= 0)
+            return used > 0 ? (ssize_t)used : bytes;
+        trace_mark(trace, TRACE_FIRST_BYTE);
+
+        size_t search_from  = used > 3 ? used - 3 : 0;
+        used               += bytes;
+        buffer->data[used]  = '\0';
+
+        char* end = strstr(buffer->data + search_from, "\r\n\r\n");
+        if (end)
+            return (size_t)(end - buffer->data) + 4 <= max_size
+                       ? (ssize_t)used
+                       : REQUEST_TOO_LARGE;
+    }
+}
+
+// Apply an optional tuning option to the listening socket. Failures are
+// reported but not fatal, since the server works without them.
+static void set_listen_option(int fd, int level, int name, int value,
+                              const char* description) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0)
+        fprintf(stderr, "Warning: failed to set %s: %s\n", description,
+                strerror(errno));
+}
+
+// Find the route a raw request is for, which is the first path segment
+// ("/static/" for "GET /static/index.html HTTP/1.1"). Works on the
+// unparsed request so limits apply before any parsing work.
+static const char* find_route(const char* data, size_t* length) {
+    const char* path = strchr(data, ' ');
+    if (!path || path[1] != '/')
+        return NULL;
+    path++;
+
+    size_t end = 1;
+    while (path[end] && path[end] != '/' && path[end] != ' ' &&
+           path[end] != '?' && path[end] != '\r')
+        end++;
+    if (path[end] == '/')
+        end++;
+
+    *length = end;
+    return path;
+}
+
+// Answer a client over its limit without reading the rest of its request.
+// Whatever it already sent is drained first, otherwise close() would reset
+// the connection and the client might never see the response.
+static void reject_rate_limited(connection_t* conn) {
+    connection_send_all(conn, RATE_LIMITED_RESPONSE,
+                        sizeof(RATE_LIMITED_RESPONSE) - 1, MSG_DONTWAIT);
+    if (!conn->ssl) {
+        char drain[DRAIN_SIZE];
+        shutdown(conn->fd, SHUT_WR);
+        while (recv(conn->fd, drain, sizeof(drain), MSG_DONTWAIT) > 0)
+            ;
+    }
+}
+
+typedef struct {
+    int client_fd;
+    pool_buffer_t* buffer;
+    size_t length;
+    const http_request_t* upgrade_request;
+} http2_handoff_t;
+
+static void run_http2(void* arg) {
+    http2_handoff_t* handoff = arg;
+    http2_serve_connection(handoff->client_fd, handoff->buffer,
+                           handoff->length, handoff->upgrade_request);
+}
+
+// Serve an HTTP/2 connection. Its streams run on threads of their own with
+// blocking I/O, so a coroutine hands the whole connection to a thread and
+// waits for it rather than stalling its worker.
+static void serve_http2(int client_fd, pool_buffer_t* buffer, size_t length,
+                        const http_request_t* upgrade_request) {
+    http2_handoff_t handoff = {client_fd, buffer, length, upgrade_request};
+
+    if (coroutine_active())
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) & ~O_NONBLOCK);
+    coroutine_offload(run_http2, &handoff);
+}
+
+// Parse and answer a single HTTP/1.x request
+static void handle_http1_request(connection_t* conn, pool_buffer_t* buffer,
+                                 const server_config_t* config,
+                                 trace_context_t* trace) {
+    // Parse the request, then hand the buffer back before the handler runs
+    http_request_t request;
+    int parsed = parse_request(buffer->data, &request);
+    buffer_pool_release(buffer);
+    trace_mark(trace, TRACE_PARSED);
+
+    if (parsed == 0) {
+        request.local_peer = connection_is_local(conn->fd);
+
+        if (!conn->ssl && http2_is_upgrade_request(&request)) {
+            // Upgrade: h2c, the request becomes HTTP/2 stream 1
+            serve_http2(conn->fd, NULL, 0, &request);
+            return;
+        }
+
+        // Create a response
+        http_response_t response;
+        init_response(&response);
+
+        // Route the request to the appropriate handler
+        trace_set_path(trace, request.path);
+        trace_mark(trace, TRACE_DISPATCH);
+        route_request(&request, &response);
+        trace_mark(trace, TRACE_HANDLED);
+
+        // Send the response
+        send_response(conn, &response, config, trace);
+
+        // Free response resources
+        free_response(&response);
+    } else {
+        // Bad request
+        send_error_response(conn, 400, "Bad Request", config, trace);
+    }
+}
+
+// Describe a peer for logging
+static void format_peer(const struct sockaddr_storage* addr, char* name,
+                        size_t name_size) {
+    char ip[INET6_ADDRSTRLEN];
+
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+        inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+        snprintf(name, name_size, "%s:%d", ip, ntohs(in->sin_port));
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+        snprintf(name, name_size, "[%s]:%d", ip, ntohs(in6->sin6_port));
+    } else if (addr->ss_family == AF_UNIX) {
+        // Clients of a Unix socket are usually unnamed
+        const struct sockaddr_un* un = (const struct sockaddr_un*)addr;
+        snprintf(name, name_size, "unix:%s",
+                 un->sun_path[0] ? un->sun_path : "(unnamed)");
+    } else {
+        snprintf(name, name_size, "(family %d)", addr->ss_family);
+    }
+}
+
+// Rate limits are kept per IPv4 address. Other peers, such as a front
+// proxy on a Unix socket, are not limited.
+static int limit_request(const struct sockaddr_storage* addr,
+                         const char* route, size_t route_length) {
+    if (addr->ss_family != AF_INET)
+        return 0;
+    const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+    return !rate_limit_allow(in->sin_addr.s_addr, route, route_length);
+}
+
 // Thread function to handle a client connection
 void* handle_client(void* arg) {
-    client_info_t* client_info     = (client_info_t*)arg;
-    int client_fd                  = client_info->client_fd;
-    struct sockaddr_in client_addr = client_info->client_addr;
+    client_info_t* client_info          = (client_info_t*)arg;
+    int client_fd                       = client_info->client_fd;
+    struct sockaddr_storage client_addr = client_info->client_addr;
+    const server_config_t* config       = client_info->config;
+
+    int rate_limited = client_info->rate_limited;
+
+    trace_context_t trace;
+    trace_begin(&trace, client_info->accept_time);
 
     // Free the client_info structure as we've extracted what we need
     free(client_info);
 
-    // Get client IP address as string
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-    printf("Connection from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
+    // Get client address as string
+    char client_name[PEER_NAME_LENGTH];
+    format_peer(&client_addr, client_name, sizeof(client_name));
+    printf("Connection from %s\n", client_name);
 
-    // Buffer for receiving data
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
+    connection_t conn = {client_fd, NULL};
+    if (config->cert_file) {
+        conn.ssl = tls_accept(client_fd);
+        if (!conn.ssl) {
+            printf("TLS handshake failed with %s\n", client_name);
+            close(client_fd);
+            return NULL;
+        }
+    }
+
+    if (rate_limited) {
+        reject_rate_limited(&conn);
+        tls_close(conn.ssl);
+        close(client_fd);
+        return NULL;
+    }
+
+    // Borrow a small buffer for receiving; it grows only for large headers
+    pool_buffer_t buffer   = {NULL, 0, 0};
+    ssize_t bytes_received = -1;
 
     // Read the request
-    bytes_received = recv(client_fd, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes_received > 0) {
-        // Null-terminate the received data
-        buffer[bytes_received] = '\0';
-
-        // Parse the request
-        http_request_t request;
-        if (parse_request(buffer, &request) == 0) {
-            // Create a response
-            http_response_t response;
-            init_response(&response);
-
-            // Route the request to the appropriate handler
-            if (strncmp(request.path, "/static/", 8) == 0) {
-                handle_static_request(&request, &response);
-            } else if (strncmp(request.path, "/calc/", 6) == 0) {
-                handle_calc_request(&request, &response);
-            } else if (strncmp(request.path, "/sleep/", 7) == 0) {
-                handle_sleep_request(&request, &response);
-            } else {
-                // Handle 404 Not Found
-                set_response_status(&response, 404, "Not Found");
-                set_response_content_type(&response, "text/plain");
-                set_response_content(&response, "404 Not Found", 13);
-            }
-
-            // Send the response
-            char response_buffer[BUFFER_SIZE];
-            int response_size =
-                format_response(&response, response_buffer, BUFFER_SIZE);
-            send(client_fd, response_buffer, response_size, 0);
-
-            // Free response resources
-            free_response(&response);
+    if (buffer_pool_acquire(&buffer, BUFFER_POOL_MIN_SIZE) == 0)
+        bytes_received =
+            read_request(&conn, &buffer, config->max_header_size, &trace);
+
+    if (bytes_received == REQUEST_TOO_LARGE) {
+        buffer_pool_release(&buffer);
+        send_error_response(&conn, 431, "Request Header Fields Too Large",
+                            config, &trace);
+    } else if (bytes_received > 0) {
+        const char* route;
+        size_t route_length;
+        if (config->route_rate_limit &&
+            (route = find_route(buffer.data, &route_length)) &&
+            limit_request(&client_addr, route, route_length)) {
+            buffer_pool_release(&buffer);
+            reject_rate_limited(&conn);
+        } else if (!conn.ssl &&
+                   http2_is_preface(buffer.data, bytes_received)) {
+            // HTTP/2 with prior knowledge, the connection takes the buffer
+            serve_http2(client_fd, &buffer, bytes_received, NULL);
         } else {
-            // Bad request
-            http_response_t response;
-            init_response(&response);
-            set_response_status(&response, 400, "Bad Request");
-            set_response_content_type(&response, "text/plain");
-            set_response_content(&response, "400 Bad Request", 15);
-
-            char response_buffer[BUFFER_SIZE];
-            int response_size =
-                format_response(&response, response_buffer, BUFFER_SIZE);
-            send(client_fd, response_buffer, response_size, 0);
-
-            free_response(&response);
+            handle_http1_request(&conn, &buffer, config, &trace);
         }
+    } else {
+        buffer_pool_release(&buffer);
     }
 
+    trace_end(&trace);
+
     // Close the connection
+    tls_close(conn.ssl);
     close(client_fd);
-    printf("Connection closed with %s:%d\n", client_ip,
-           ntohs(client_addr.sin_port));
+    printf("Connection closed with %s\n", client_name);
 
     return NULL;
 }
 
-int start_server(int port) {
-    // Ignore SIGPIPE signal (happens when client disconnects)
-    signal(SIGPIPE, SIG_IGN);
-
+// Create the TCP listening socket, applying the optional tuning options.
+// Returns the socket, or -1 on error.
+static int create_tcp_listener(const server_config_t* config) {
     // Create socket
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_fd < 0) {
         perror("Failed to create socket");
-        return 1;
+        return -1;
     }
 
     // Set socket options
@@ -117,71 +441,240 @@ int start_server(int port) {
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
         perror("Failed to set socket options");
         close(server_fd);
-        return 1;
+        return -1;
     }
 
+    // Accepted sockets inherit these options from the listening socket
+    if (config->nodelay)
+        set_listen_option(server_fd, IPPROTO_TCP, TCP_NODELAY, 1,
+                          "TCP_NODELAY");
+    if (config->busy_poll > 0)
+        set_listen_option(server_fd, SOL_SOCKET, SO_BUSY_POLL,
+                          config->busy_poll, "SO_BUSY_POLL");
+
+    // Only wake up accept() once the client has sent request data
+    if (config->defer_accept > 0)
+        set_listen_option(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                          config->defer_accept, "TCP_DEFER_ACCEPT");
+
+    // Must be set before listen()
+    if (config->fastopen > 0)
+        set_listen_option(server_fd, IPPROTO_TCP, TCP_FASTOPEN,
+                          config->fastopen, "TCP_FASTOPEN");
+
     // Prepare the server address structure
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family      = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port        = htons(port);
+    server_addr.sin_port        = htons(config->port);
 
     // Bind socket to address
     if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) <
         0) {
         perror("Failed to bind socket");
         close(server_fd);
-        return 1;
+        return -1;
     }
 
     // Start listening
-    if (listen(server_fd, MAX_CONNECTIONS) < 0) {
+    if (listen(server_fd, config->backlog) < 0) {
         perror("Failed to listen");
         close(server_fd);
-        return 1;
+        return -1;
     }
 
-    printf("Server listening on port %d\n", port);
+    return server_fd;
+}
 
-    // Accept connections and create threads to handle them
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len = sizeof(client_addr);
+// Create a Unix domain listening socket for clients on the same host, such
+// as a front proxy. Returns the socket, or -1 on error.
+static int create_unix_listener(const server_config_t* config) {
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    if (strlen(config->unix_socket) >= sizeof(server_addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n",
+                config->unix_socket);
+        return -1;
+    }
+    strcpy(server_addr.sun_path, config->unix_socket);
 
-        int client_fd =
-            accept(server_fd, (struct sockaddr*)&client_addr, &client_addr_len);
-        if (client_fd < 0) {
-            perror("Failed to accept connection");
-            continue;
-        }
+    // A socket file left behind by a previous run would make bind() fail.
+    // Anything else at that path is left alone.
+    struct stat st;
+    if (lstat(config->unix_socket, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(config->unix_socket);
 
-        // Create a structure to pass to the thread
-        client_info_t* client_info = malloc(sizeof(client_info_t));
-        if (!client_info) {
-            perror("Failed to allocate memory for client info");
-            close(client_fd);
-            continue;
-        }
+    int server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_fd < 0) {
+        perror("Failed to create Unix socket");
+        return -1;
+    }
+
+    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) <
+        0) {
+        perror("Failed to bind Unix socket");
+        close(server_fd);
+        return -1;
+    }
+
+    if (listen(server_fd, config->backlog) < 0) {
+        perror("Failed to listen on Unix socket");
+        close(server_fd);
+        unlink(config->unix_socket);
+        return -1;
+    }
+
+    // The server runs until it is killed, so that is when the file goes
+    unix_socket_path = config->unix_socket;
+    signal(SIGINT, remove_unix_socket);
+    signal(SIGTERM, remove_unix_socket);
+    signal(SIGHUP, remove_unix_socket);
 
-        client_info->client_fd   = client_fd;
-        client_info->client_addr = client_addr;
+    return server_fd;
+}
+
+// Accept one connection and start a thread or coroutine for it
+static void accept_connection(int server_fd, const server_config_t* config) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+
+    // Client sockets stay blocking when each one has its own thread.
+    // Coroutines need non-blocking sockets to suspend instead.
+    int flags     = SOCK_CLOEXEC | (config->workers > 0 ? SOCK_NONBLOCK : 0);
+    int client_fd = accept4(server_fd, (struct sockaddr*)&client_addr,
+                            &client_addr_len, flags);
+    if (client_fd < 0) {
+        perror("Failed to accept connection");
+        return;
+    }
+    uint64_t accept_time = trace_enabled() ? trace_now() : 0;
 
-        // Create a thread to handle the connection
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, client_info) != 0) {
-            perror("Failed to create thread");
+    // Turn away clients over their limit before spending a thread on them.
+    // TLS clients get the response after their handshake.
+    int rate_limited = limit_request(&client_addr, NULL, 0);
+    if (rate_limited && !config->cert_file) {
+        connection_t conn = {client_fd, NULL};
+        reject_rate_limited(&conn);
+        close(client_fd);
+        return;
+    }
+
+    // Create a structure to pass to the thread
+    client_info_t* client_info = malloc(sizeof(client_info_t));
+    if (!client_info) {
+        perror("Failed to allocate memory for client info");
+        close(client_fd);
+        return;
+    }
+
+    client_info->client_fd    = client_fd;
+    client_info->client_addr  = client_addr;
+    client_info->config       = config;
+    client_info->accept_time  = accept_time;
+    client_info->rate_limited = rate_limited;
+
+    if (config->workers > 0) {
+        if (coroutine_spawn(handle_client, client_info) != 0) {
+            perror("Failed to create coroutine");
             free(client_info);
             close(client_fd);
+        }
+        return;
+    }
+
+    // Create a thread to handle the connection
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, handle_client, client_info) != 0) {
+        perror("Failed to create thread");
+        free(client_info);
+        close(client_fd);
+        return;
+    }
+
+    // Detach the thread so resources are automatically released when it
+    // exits
+    pthread_detach(thread_id);
+}
+
+int start_server(const server_config_t* config) {
+    // Ignore SIGPIPE signal (happens when client disconnects)
+    signal(SIGPIPE, SIG_IGN);
+
+    // The dumper has to start before any other thread exists (proxy health
+    // checks, coroutine workers, connections), so they all inherit its
+    // signal mask
+    if (config->trace_sample_rate > 0) {
+        trace_init(config->trace_sample_rate);
+        if (trace_start_signal_dumper(config->trace_file))
+            return 1;
+    }
+
+    if (config->cert_file && tls_init(config->cert_file, config->key_file))
+        return 1;
+
+    if (config->asset_pack &&
+        asset_pack_open(config->asset_pack, config->lock_assets))
+        return 1;
+
+    if (proxy_init(config->upstreams, config->num_upstreams))
+        return 1;
+
+    if (cache_init(config->cached_routes, config->num_cached_routes,
+                   config->cache_size))
+        return 1;
+
+    rate_limit_init(config->rate_limit, config->rate_burst,
+                    config->route_rate_limit);
+
+    // Workers start after the dumper for the same reason
+    if (config->workers > 0) {
+        if (coroutine_init(config->workers))
+            return 1;
+        printf("Serving connections on %d coroutine workers\n",
+               config->workers);
+    }
+
+    struct pollfd listeners[MAX_LISTENERS];
+    int num_listeners = 0;
+
+    if (config->port > 0) {
+        int server_fd = create_tcp_listener(config);
+        if (server_fd < 0)
+            return 1;
+        listeners[num_listeners++] = (struct pollfd){server_fd, POLLIN, 0};
+        printf("Server listening on port %d\n", config->port);
+    }
+
+    if (config->unix_socket) {
+        int server_fd = create_unix_listener(config);
+        if (server_fd < 0)
+            return 1;
+        listeners[num_listeners++] = (struct pollfd){server_fd, POLLIN, 0};
+        printf("Server listening on %s\n", config->unix_socket);
+    }
+
+    // Accept connections and create threads to handle them. With a single
+    // listener accept() blocks directly, saving a poll() per connection.
+    while (1) {
+        if (num_listeners == 1) {
+            accept_connection(listeners[0].fd, config);
             continue;
         }
 
-        // Detach the thread so resources are automatically released when it
-        // exits
-        pthread_detach(thread_id);
+        if (poll(listeners, num_listeners, -1) < 0) {
+            if (errno != EINTR)
+                perror("Failed to poll listeners");
+            continue;
+        }
+        for (int i = 0; i < num_listeners; i++)
+            if (listeners[i].revents & POLLIN)
+                accept_connection(listeners[i].fd, config);
     }
 
     // We'll never get here, but it's good practice
-    close(server_fd);
+    for (int i = 0; i < num_listeners; i++)
+        close(listeners[i].fd);
     return 0;
 }
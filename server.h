@@ -1,11 +1,50 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#define MAX_UPSTREAMS 16
+#define MAX_CACHED_ROUTES 16
+
+typedef struct {
+    int port;                // TCP port (0 = no TCP listener)
+    int backlog;             // listen() backlog
+    int defer_accept;        // TCP_DEFER_ACCEPT timeout in seconds (0 = off)
+    int fastopen;            // TCP_FASTOPEN queue length (0 = off)
+    int nodelay;             // Set TCP_NODELAY on client sockets
+    int cork;                // Cork header + body writes with TCP_CORK
+    int busy_poll;           // SO_BUSY_POLL budget in microseconds (0 = off)
+    const char* cert_file;   // PEM certificate chain, enables TLS if set
+    const char* key_file;    // PEM private key
+    const char* asset_pack;  // Packed static assets to serve, or NULL
+    int lock_assets;         // mlock() the asset pack
+    int max_header_size;     // Largest request header block accepted
+    int trace_sample_rate;   // Trace one in this many requests (0 = off)
+    const char* trace_file;  // Where SIGUSR1 writes the trace
+    int rate_limit;          // Requests per second per client (0 = off)
+    int rate_burst;          // Requests a client may burst (0 = rate_limit)
+    int route_rate_limit;    // Requests per second per client and route
+    // Backends for /proxy/, as "host:port"
+    const char* upstreams[MAX_UPSTREAMS];
+    int num_upstreams;
+    // Path prefixes to micro-cache, as "prefix=ttl_ms"
+    const char* cached_routes[MAX_CACHED_ROUTES];
+    int num_cached_routes;
+    long cache_size;          // Memory the micro-cache may use in bytes
+    const char* unix_socket;  // Also listen on this Unix socket path
+    int workers;              // Coroutine worker threads, 0 for a thread
+                              // per connection
+} server_config_t;
+
+/**
+ * Fill a server configuration with default values
+ * @param config Pointer to the configuration to initialize
+ */
+void init_server_config(server_config_t* config);
+
 /**
- * Start the HTTP server on the specified port
- * @param port Port number to listen on
+ * Start the HTTP server with the given configuration
+ * @param config Server configuration
  * @return 0 on success, non-zero on error
  */
-int start_server(int port);
+int start_server(const server_config_t* config);
 
 #endif /* SERVER_H */
@@ -0,0 +1,149 @@
+// Tests for the expression compiler and its program cache. Includes expr.c
+// to look at the cache slots.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../expr.c"
+
+#define CHECK(condition)                                              \
+    do {                                                              \
+        if (!(condition)) {                                           \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,    \
+                    __LINE__, #condition);                            \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+static int failures = 0;
+
+static int evaluates_to(const char* expression, double expected) {
+    char error[128];
+    double result;
+    if (expr_evaluate(expression, &result, error, sizeof(error)) != 0) {
+        fprintf(stderr, "%s: %s\n", expression, error);
+        return 0;
+    }
+    return fabs(result - expected) < 1e-9;
+}
+
+// Fails with an error message containing the given text
+static int fails_with(const char* expression, const char* message) {
+    char error[128] = "";
+    double result;
+    return expr_evaluate(expression, &result, error, sizeof(error)) != 0 &&
+           strstr(error, message) != NULL;
+}
+
+static int used_slots(void) {
+    int used = 0;
+    for (int i = 0; i < CACHE_SLOTS; i++)
+        used += cache[i].used;
+    return used;
+}
+
+// Two expressions of the same shape compile once and keep their numbers
+static void test_cache(void) {
+    CHECK(used_slots() == 0);
+    CHECK(evaluates_to("1+2*3", 7));
+    CHECK(used_slots() == 1);
+    CHECK(evaluates_to("4 + 5 * 6", 34));
+    CHECK(used_slots() == 1);
+
+    split_expr_t split;
+    char error[128];
+    CHECK(split_expression("4 + 5 * 6", &split, error, sizeof(error)) == 0);
+    CHECK(strcmp(split.shape, "#+#*#") == 0);
+    CHECK(split.num_params == 3 && split.params[2] == 6);
+}
+
+static void test_precedence(void) {
+    CHECK(evaluates_to("2+3*4", 14));
+    CHECK(evaluates_to("(2+3)*4", 20));
+    CHECK(evaluates_to("10-4-3", 3));
+    CHECK(evaluates_to("2*3^2", 18));
+    CHECK(evaluates_to("7%4*2", 6));
+    CHECK(evaluates_to("-2^2", -4));
+    CHECK(evaluates_to("2^-1", 0.5));
+    CHECK(evaluates_to("--3", 3));
+}
+
+static void test_right_associativity(void) {
+    CHECK(evaluates_to("2^3^2", 512));
+    CHECK(evaluates_to("(2^3)^2", 64));
+}
+
+static void test_functions(void) {
+    CHECK(evaluates_to("sqrt(16)+abs(-2)", 6));
+    CHECK(evaluates_to("pow(2,10)", 1024));
+    CHECK(evaluates_to("max(1,5,3)-min(4,2)", 3));
+    CHECK(evaluates_to("2*pi", 2 * M_PI));
+
+    CHECK(fails_with("sin(1,2)", "Wrong number of arguments"));
+    CHECK(fails_with("pow(2)", "Wrong number of arguments"));
+    CHECK(fails_with("min()", "Wrong number of arguments"));
+    CHECK(fails_with("foo(1)", "Unknown name"));
+}
+
+static void test_numbers(void) {
+    CHECK(evaluates_to("1.5+.5", 2));
+    CHECK(evaluates_to("1e3", 1000));
+    CHECK(evaluates_to("2.5E-1*4", 1));
+    CHECK(evaluates_to("e^1e0", M_E));
+
+    // Only decimal literals are numbers
+    CHECK(fails_with("0x10", "Unexpected token"));
+    CHECK(fails_with("1+0X1p4", "Unexpected token"));
+    CHECK(fails_with("nan", "Unknown name"));
+    CHECK(fails_with("1/0", "not a finite number"));
+}
+
+static void test_nesting(void) {
+    char expression[EXPR_MAX_LENGTH];
+
+    for (int depth = MAX_NESTING; depth <= MAX_NESTING + 1; depth++) {
+        size_t length = 0;
+        for (int i = 0; i < depth; i++)
+            expression[length++] = '(';
+        expression[length++] = '1';
+        for (int i = 0; i < depth; i++)
+            expression[length++] = ')';
+        expression[length] = '\0';
+
+        if (depth == MAX_NESTING)
+            CHECK(evaluates_to(expression, 1));
+        else
+            CHECK(fails_with(expression, "nested too deeply"));
+    }
+
+    // Unary minus and exponents count towards the limit too
+    memset(expression, '-', MAX_NESTING + 1);
+    strcpy(expression + MAX_NESTING + 1, "1");
+    CHECK(fails_with(expression, "nested too deeply"));
+}
+
+static void test_syntax_errors(void) {
+    CHECK(fails_with("1+", ""));
+    CHECK(fails_with("(1+2", ""));
+    CHECK(fails_with("1 2", ""));
+    CHECK(fails_with("1&2", "Unexpected character"));
+}
+
+int main(void) {
+    // First, while the cache is empty
+    test_cache();
+    test_precedence();
+    test_right_associativity();
+    test_functions();
+    test_numbers();
+    test_nesting();
+    test_syntax_errors();
+
+    if (failures) {
+        fprintf(stderr, "test_expr: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_expr: ok\n");
+    return 0;
+}
@@ -0,0 +1,91 @@
+// Decoder tests for hpack.c. Built with AddressSanitizer by `make test`.
+#include <stdio.h>
+#include <string.h>
+
+#include "../hpack.h"
+
+#define CHECK(condition)                                              \
+    do {                                                              \
+        if (!(condition)) {                                           \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,    \
+                    __LINE__, #condition);                            \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+static int failures = 0;
+
+typedef struct {
+    char name[64];
+    char value[64];
+    int count;
+} last_header_t;
+
+static int on_header(void* arg, const char* name, size_t name_length,
+                     const char* value, size_t value_length) {
+    last_header_t* last = arg;
+    snprintf(last->name, sizeof(last->name), "%.*s", (int)name_length, name);
+    snprintf(last->value, sizeof(last->value), "%.*s", (int)value_length,
+             value);
+    last->count++;
+    return 0;
+}
+
+// A literal with incremental indexing whose name comes from the only
+// dynamic entry, in a table too small to hold both: adding the new entry
+// evicts the one its name was taken from
+static void test_indexed_name_from_evicted_entry(void) {
+    hpack_table_t table;
+    hpack_table_init(&table, 64);
+    last_header_t last = {0};
+
+    // New name "x-a", value "1": 3 + 1 + 32 = 36 bytes
+    const uint8_t first[] = {0x40, 0x03, 'x', '-', 'a', 0x01, '1'};
+    CHECK(hpack_decode(&table, first, sizeof(first), 64, on_header, &last) ==
+          0);
+    CHECK(table.num_entries == 1);
+
+    // Name from index 62 (newest dynamic entry), value "22222": 40 bytes
+    const uint8_t second[] = {0x7e, 0x05, '2', '2', '2', '2', '2'};
+    CHECK(hpack_decode(&table, second, sizeof(second), 64, on_header,
+                       &last) == 0);
+    CHECK(last.count == 2);
+    CHECK(strcmp(last.name, "x-a") == 0);
+    CHECK(strcmp(last.value, "22222") == 0);
+    CHECK(table.num_entries == 1 && strcmp(table.entries[0].name, "x-a") == 0);
+    CHECK(table.num_entries == 1 &&
+          strcmp(table.entries[0].value, "22222") == 0);
+    CHECK(table.size == 40);
+
+    // The new entry is now the one at index 62
+    const uint8_t third[] = {0xbe};
+    CHECK(hpack_decode(&table, third, sizeof(third), 64, on_header, &last) ==
+          0);
+    CHECK(strcmp(last.name, "x-a") == 0 && strcmp(last.value, "22222") == 0);
+
+    hpack_table_free(&table);
+}
+
+static void test_index_out_of_range(void) {
+    hpack_table_t table;
+    hpack_table_init(&table, HPACK_DEFAULT_TABLE_SIZE);
+    last_header_t last = {0};
+
+    const uint8_t block[] = {0xbe};  // Index 62 with an empty dynamic table
+    CHECK(hpack_decode(&table, block, sizeof(block), HPACK_DEFAULT_TABLE_SIZE,
+                       on_header, &last) != 0);
+
+    hpack_table_free(&table);
+}
+
+int main(void) {
+    test_indexed_name_from_evicted_entry();
+    test_index_out_of_range();
+
+    if (failures) {
+        fprintf(stderr, "test_hpack: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("test_hpack: ok\n");
+    return 0;
+}
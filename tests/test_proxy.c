@@ -0,0 +1,264 @@
+// Tests for proxy.c against a stub upstream on a loopback port. Built with
+// AddressSanitizer by `make test`.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../proxy.h"
+
+#define CHECK(condition)                                              \
+    do {                                                              \
+        if (!(condition)) {                                           \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,    \
+                    __LINE__, #condition);                            \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+static int failures = 0;
+
+// What the stub answers with, and the last request it received. Requests
+// are sent one at a time, so the test and the stub take turns.
+static char canned[16384];
+static char last_request[4096];
+static int requests_served = 0;
+static pthread_mutex_t stub_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* run_stub(void* arg) {
+    int listen_fd = *(int*)arg;
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        // Health probes connect and close without a request
+        char request[sizeof(last_request)];
+        size_t length = 0;
+        while (length < sizeof(request) - 1) {
+            ssize_t bytes = recv(fd, request + length,
+                                 sizeof(request) - 1 - length, 0);
+            if (bytes <= 0)
+                break;
+            length         += bytes;
+            request[length] = '\0';
+            if (strstr(request, "\r\n\r\n"))
+                break;
+        }
+
+        if (length > 0) {
+            pthread_mutex_lock(&stub_lock);
+            memcpy(last_request, request, length + 1);
+            requests_served++;
+            send(fd, canned, strlen(canned), MSG_NOSIGNAL);
+            pthread_mutex_unlock(&stub_lock);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// Listen on an ephemeral loopback port and point the proxy at it
+static int start_stub(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length     = sizeof(addr);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 16) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &length) != 0)
+        return -1;
+
+    static int listen_fd;
+    listen_fd = fd;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_stub, &listen_fd) != 0)
+        return -1;
+    pthread_detach(thread);
+
+    static char upstream[32];
+    snprintf(upstream, sizeof(upstream), "127.0.0.1:%d",
+             ntohs(addr.sin_port));
+    const char* upstreams[] = {upstream};
+    return proxy_init(upstreams, 1);
+}
+
+static void set_canned(const char* response) {
+    pthread_mutex_lock(&stub_lock);
+    snprintf(canned, sizeof(canned), "%s", response);
+    pthread_mutex_unlock(&stub_lock);
+}
+
+static void make_request(http_request_t* request, const char* path) {
+    memset(request, 0, sizeof(http_request_t));
+    strcpy(request->method, "GET");
+    snprintf(request->path, sizeof(request->path), "/proxy%s", path);
+    strcpy(request->http_version, "HTTP/1.1");
+}
+
+static void add_request_header(http_request_t* request, const char* name,
+                               const char* value) {
+    http_header_t* header = &request->headers[request->num_headers++];
+    snprintf(header->name, sizeof(header->name), "%s", name);
+    snprintf(header->value, sizeof(header->value), "%s", value);
+}
+
+static int count_headers(const http_response_t* response, const char* name) {
+    int count = 0;
+    for (int i = 0; i < response->num_headers; i++)
+        count += strcasecmp(response->header_names[i], name) == 0;
+    return count;
+}
+
+static const char* find_header(const http_response_t* response,
+                               const char* name) {
+    for (int i = 0; i < response->num_headers; i++)
+        if (strcasecmp(response->header_names[i], name) == 0)
+            return response->header_values[i];
+    return NULL;
+}
+
+static void forward(const char* path, http_request_t* request,
+                    http_response_t* response) {
+    init_response(response);
+    proxy_forward(request, path, response);
+}
+
+// Repeated headers all reach the client, upstream Server replaces ours,
+// and hop-by-hop headers are dropped in both directions
+static void test_headers_forwarded(void) {
+    set_canned(
+        "HTTP/1.1 200 OK\r\n"
+        "Set-Cookie: a=1\r\n"
+        "Set-Cookie: b=2\r\n"
+        "Server: stub\r\n"
+        "Keep-Alive: timeout=5\r\n"
+        "Content-Length: 2\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "hi");
+
+    http_request_t request;
+    make_request(&request, "/users?id=1");
+    add_request_header(&request, "Accept", "*/*");
+    add_request_header(&request, "Connection", "Upgrade");
+
+    http_response_t response;
+    forward("/users?id=1", &request, &response);
+
+    CHECK(response.status_code == 200);
+    CHECK(response.content_length == 2 &&
+          memcmp(response.content, "hi", 2) == 0);
+    CHECK(count_headers(&response, "Set-Cookie") == 2);
+    CHECK(count_headers(&response, "Server") == 1);
+    CHECK(find_header(&response, "Server") &&
+          strcmp(find_header(&response, "Server"), "stub") == 0);
+    CHECK(count_headers(&response, "Keep-Alive") == 0);
+
+    CHECK(strncmp(last_request, "GET /users?id=1 HTTP/1.1\r\n", 26) == 0);
+    CHECK(strstr(last_request, "\r\nAccept: */*\r\n") != NULL);
+    CHECK(strstr(last_request, "Upgrade") == NULL);
+    free_response(&response);
+}
+
+static void test_chunked_body(void) {
+    set_canned(
+        "HTTP/1.1 200 OK\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "2\r\nhi\r\n3\r\n!!!\r\n0\r\n\r\n");
+
+    http_request_t request;
+    make_request(&request, "/chunked");
+    http_response_t response;
+    forward("/chunked", &request, &response);
+
+    CHECK(response.status_code == 200);
+    CHECK(response.content_length == 5 &&
+          memcmp(response.content, "hi!!!", 5) == 0);
+    CHECK(count_headers(&response, "Transfer-Encoding") == 0);
+    free_response(&response);
+}
+
+// More header bytes than the proxy forwards is a bad gateway
+static void test_oversized_headers(void) {
+    char response_text[sizeof(canned)];
+    size_t length = snprintf(response_text, sizeof(response_text),
+                             "HTTP/1.1 200 OK\r\n");
+    char value[1001];
+    memset(value, 'v', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+    for (int i = 0; i < 10; i++)
+        length += snprintf(response_text + length,
+                           sizeof(response_text) - length, "X-Big-%d: %s\r\n",
+                           i, value);
+    snprintf(response_text + length, sizeof(response_text) - length,
+             "Content-Length: 2\r\nConnection: close\r\n\r\nhi");
+    set_canned(response_text);
+
+    http_request_t request;
+    make_request(&request, "/big");
+    http_response_t response;
+    forward("/big", &request, &response);
+
+    CHECK(response.status_code == 502);
+    CHECK(count_headers(&response, "X-Big-0") == 0);
+    free_response(&response);
+}
+
+// A line break in a field would start a new header upstream
+static void test_line_break_refused(void) {
+    set_canned("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+    int served = requests_served;
+
+    http_request_t request;
+    make_request(&request, "/x");
+    add_request_header(&request, "X-Note", "a\r\nInjected: 1");
+    http_response_t response;
+    forward("/x", &request, &response);
+
+    CHECK(response.status_code == 400);
+    CHECK(requests_served == served);
+    free_response(&response);
+}
+
+static void test_garbage_status(void) {
+    set_canned("SMTP ready\r\n\r\n");
+
+    http_request_t request;
+    make_request(&request, "/garbage");
+    http_response_t response;
+    forward("/garbage", &request, &response);
+
+    CHECK(response.status_code == 502);
+    free_response(&response);
+}
+
+int main(void) {
+    if (start_stub() != 0) {
+        fprintf(stderr, "test_proxy: could not start the stub upstream\n");
+        return 1;
+    }
+
+    test_headers_forwarded();
+    test_chunked_body();
+    test_oversized_headers();
+    test_line_break_refused();
+    test_garbage_status();
+
+    if (failures) {
+        fprintf(stderr, "test_proxy: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_proxy: ok\n");
+    return 0;
+}
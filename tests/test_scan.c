@@ -0,0 +1,120 @@
+// Checks that the SSE4.2 and AVX2 kernels in scan.c find the same bytes as
+// the scalar one. Includes scan.c to reach its static kernels.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../scan.c"
+
+#define CHECK(condition)                                              \
+    do {                                                              \
+        if (!(condition)) {                                           \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,    \
+                    __LINE__, #condition);                            \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+#define BUFFER_SIZE 512
+#define RANDOM_ROUNDS 200000
+
+static int failures = 0;
+
+typedef struct {
+    const char* name;
+    find_special_fn find_special;
+} kernel_t;
+
+static kernel_t kernels[3];
+static int num_kernels = 0;
+
+static void find_kernels(void) {
+    kernels[num_kernels++] = (kernel_t){"scalar", find_special_scalar};
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        kernels[num_kernels++] = (kernel_t){"sse4.2", find_special_sse42};
+    if (__builtin_cpu_supports("avx2"))
+        kernels[num_kernels++] = (kernel_t){"avx2", find_special_avx2};
+#endif
+}
+
+// Compare every kernel with the scalar one on one buffer, and scan_line()
+// run with each of them
+static void check_buffer(const char* data, size_t length) {
+    size_t expected = find_special_scalar(data, length);
+    scan_line_t expected_line;
+    atomic_store(&kernel, find_special_scalar);
+    scan_line(data, length, &expected_line);
+
+    for (int k = 1; k < num_kernels; k++) {
+        size_t found = kernels[k].find_special(data, length);
+        if (found != expected) {
+            fprintf(stderr, "%s found %zu, scalar %zu (length %zu)\n",
+                    kernels[k].name, found, expected, length);
+            failures++;
+        }
+
+        scan_line_t line;
+        atomic_store(&kernel, kernels[k].find_special);
+        scan_line(data, length, &line);
+        CHECK(line.length == expected_line.length);
+        CHECK(line.colon == expected_line.colon);
+        CHECK(line.invalid == expected_line.invalid);
+    }
+}
+
+// Every byte value at every position of a block of ordinary bytes, so each
+// one is seen in the vector loops and in the scalar tail
+static void test_each_byte(void) {
+    char block[64];
+    for (int value = 0; value < 256; value++) {
+        for (size_t position = 0; position < sizeof(block); position++) {
+            memset(block, 'a', sizeof(block));
+            block[position] = (char)value;
+            check_buffer(block, sizeof(block));
+        }
+    }
+}
+
+// Mostly printable bytes with the occasional special or high byte, at
+// random lengths and alignments. The buffer is copied to the heap at its
+// exact length so AddressSanitizer catches loads past the end.
+static void test_random_buffers(void) {
+    static const char rare[] = {'\0', '\t', '\r', '\n', ':', 0x1f, 0x7f,
+                                (char)0x80, (char)0xff};
+    char source[BUFFER_SIZE];
+
+    for (int round = 0; round < RANDOM_ROUNDS; round++) {
+        size_t length = rand() % BUFFER_SIZE;
+        for (size_t i = 0; i < length; i++) {
+            source[i] = rand() % 64 == 0 ? rare[rand() % sizeof(rare)]
+                                         : (char)(' ' + rand() % 95);
+        }
+
+        char* data = malloc(length ? length : 1);
+        memcpy(data, source, length);
+        check_buffer(data, length);
+        free(data);
+    }
+}
+
+int main(void) {
+    srand(1);
+    find_kernels();
+    if (num_kernels == 1)
+        printf("test_scan: no vector kernels on this CPU\n");
+
+    test_each_byte();
+    test_random_buffers();
+
+    if (failures) {
+        fprintf(stderr, "test_scan: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_scan: ok (");
+    for (int k = 0; k < num_kernels; k++)
+        printf("%s%s", k ? ", " : "", kernels[k].name);
+    printf(")\n");
+    return 0;
+}
@@ -0,0 +1,222 @@
+// Serves a file over TLS on a loopback port with a throwaway self-signed
+// certificate, through both paths of connection_send_file(): SSL_sendfile()
+// when the kernel takes over record encryption (kTLS), and pread() with
+// SSL_write() otherwise. The client picks the path through the cipher, as
+// the kernel does not offload CBC suites.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../connection.h"
+#include "../tls.h"
+
+#define CHECK(condition)                                              \
+    do {                                                              \
+        if (!(condition)) {                                           \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,    \
+                    __LINE__, #condition);                            \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+#define FILE_SIZE (200 * 1024 + 123)  // Several chunks and a partial one
+#define FILE_OFFSET 4096              // Served from here to the end
+
+static int failures = 0;
+
+static int listen_fd;
+static int file_fd;
+static char file_data[FILE_SIZE];
+
+// Set by the server for the last connection
+static int used_ktls;
+
+// Write a self-signed P-256 certificate and its key to temporary files
+static int make_certificate(char* cert_path, char* key_path) {
+    EVP_PKEY* key = EVP_EC_gen("P-256");
+    X509* cert    = X509_new();
+    if (!key || !cert)
+        return -1;
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    if (!X509_sign(cert, key, EVP_sha256()))
+        return -1;
+
+    int cert_fd     = mkstemp(cert_path);
+    int key_fd      = mkstemp(key_path);
+    FILE* cert_file = cert_fd >= 0 ? fdopen(cert_fd, "w") : NULL;
+    FILE* key_file  = key_fd >= 0 ? fdopen(key_fd, "w") : NULL;
+
+    int result = -1;
+    if (cert_file && key_file && PEM_write_X509(cert_file, cert) &&
+        PEM_write_PrivateKey(key_file, key, NULL, NULL, 0, NULL, NULL))
+        result = 0;
+
+    if (cert_file)
+        fclose(cert_file);
+    if (key_file)
+        fclose(key_file);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return result;
+}
+
+// Answer one request on each connection with the tail of the file
+static void* run_server(void* arg) {
+    (void)arg;
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        connection_t conn = {fd, tls_accept(fd)};
+        char request[1024];
+        if (conn.ssl && connection_recv(&conn, request, sizeof(request)) > 0) {
+            used_ktls = BIO_get_ktls_send(SSL_get_wbio(conn.ssl)) != 0;
+
+            char header[128];
+            int length = snprintf(header, sizeof(header),
+                                  "HTTP/1.1 200 OK\r\n"
+                                  "Content-Length: %d\r\n\r\n",
+                                  FILE_SIZE - FILE_OFFSET);
+            if (connection_send_all(&conn, header, length, 0) != 0 ||
+                connection_send_file(&conn, file_fd, FILE_OFFSET,
+                                     FILE_SIZE - FILE_OFFSET) != 0)
+                fprintf(stderr, "test_tls: sending the file failed\n");
+        }
+        tls_close(conn.ssl);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int start_server(void) {
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length     = sizeof(addr);
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 16) != 0 ||
+        getsockname(listen_fd, (struct sockaddr*)&addr, &length) != 0)
+        return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_server, NULL) != 0)
+        return -1;
+    pthread_detach(thread);
+    return ntohs(addr.sin_port);
+}
+
+// Fetch the file with the given TLS 1.2 cipher list, or TLS 1.3 if NULL.
+// Returns the number of body bytes that matched the file, or -1.
+static long fetch(int port, const char* ciphers) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    if (ciphers) {
+        SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+        SSL_CTX_set_cipher_list(ctx, ciphers);
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(port);
+
+    long matched = -1;
+    SSL* ssl     = SSL_new(ctx);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+        SSL_set_fd(ssl, fd) == 1 && SSL_connect(ssl) == 1) {
+        const char* request = "GET /static/file HTTP/1.1\r\n\r\n";
+        SSL_write(ssl, request, strlen(request));
+
+        static char response[FILE_SIZE + 256];
+        size_t received = 0;
+        size_t bytes;
+        while (received < sizeof(response) &&
+               SSL_read_ex(ssl, response + received,
+                           sizeof(response) - received, &bytes) == 1)
+            received += bytes;
+
+        char* body = strstr(response, "\r\n\r\n");
+        if (body) {
+            body    += 4;
+            matched  = received - (body - response);
+            if (matched != FILE_SIZE - FILE_OFFSET ||
+                memcmp(body, file_data + FILE_OFFSET, matched) != 0)
+                matched = -1;
+        }
+    }
+
+    SSL_free(ssl);
+    close(fd);
+    SSL_CTX_free(ctx);
+    ERR_clear_error();
+    return matched;
+}
+
+int main(void) {
+    char cert_path[] = "/tmp/test_tls_cert_XXXXXX";
+    char key_path[]  = "/tmp/test_tls_key_XXXXXX";
+    int made         = make_certificate(cert_path, key_path);
+    int loaded       = made == 0 && tls_init(cert_path, key_path) == 0;
+    unlink(cert_path);
+    unlink(key_path);
+    if (!loaded) {
+        fprintf(stderr, "test_tls: could not set up the certificate\n");
+        return 1;
+    }
+
+    char file_path[] = "/tmp/test_tls_file_XXXXXX";
+    file_fd          = mkstemp(file_path);
+    unlink(file_path);
+    for (int i = 0; i < FILE_SIZE; i++)
+        file_data[i] = 'a' + (i * 7 + i / 251) % 26;
+    if (file_fd < 0 || write(file_fd, file_data, FILE_SIZE) != FILE_SIZE) {
+        fprintf(stderr, "test_tls: could not write the file\n");
+        return 1;
+    }
+
+    int port = start_server();
+    if (port < 0) {
+        fprintf(stderr, "test_tls: could not start the server\n");
+        return 1;
+    }
+
+    // AES-GCM can be offloaded when the kernel has the tls module
+    CHECK(fetch(port, NULL) == FILE_SIZE - FILE_OFFSET);
+    int ktls = used_ktls;
+
+    // CBC is never offloaded, so the file goes through pread()
+    CHECK(fetch(port, "ECDHE-ECDSA-AES128-SHA") == FILE_SIZE - FILE_OFFSET);
+    CHECK(!used_ktls);
+
+    if (failures) {
+        fprintf(stderr, "test_tls: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_tls: ok (%s)\n",
+           ktls ? "SSL_sendfile, pread" : "pread; kTLS unavailable");
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include "tls.h"
+
+#include <openssl/err.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "coroutine.h"
+
+#define SESSION_CACHE_SIZE 20480
+#define SESSION_TIMEOUT 300
+
+static SSL_CTX* tls_context = NULL;
+
+// Only HTTP/1.1 is offered over TLS: an HTTP/2 connection reads and writes
+// from several threads at once, which a single SSL object does not allow
+static int select_alpn(SSL* ssl, const unsigned char** out,
+                       unsigned char* out_length, const unsigned char* in,
+                       unsigned int in_length, void* arg) {
+    (void)ssl;
+    (void)arg;
+
+    static const unsigned char protocols[] = "\x08http/1.1";
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, out_length, protocols,
+                              sizeof(protocols) - 1, in,
+                              in_length) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(const char* cert_file, const char* key_file) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    // Hand record encryption to the kernel when it supports it, so static
+    // files can still be sent with sendfile()
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+
+    // Session resumption through both the server cache and tickets
+    static const unsigned char session_id_context[] = "SimpleHTTP";
+    SSL_CTX_set_session_id_context(ctx, session_id_context,
+                                   sizeof(session_id_context) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT);
+
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        fprintf(stderr, "Failed to load certificate or key\n");
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return 1;
+    }
+
+    tls_context = ctx;
+    return 0;
+}
+
+SSL* tls_accept(int fd) {
+    if (!tls_context)
+        return NULL;
+
+    SSL* ssl = SSL_new(tls_context);
+    if (!ssl)
+        return NULL;
+
+    int result = SSL_set_fd(ssl, fd);
+    if (result == 1)
+        while ((result = SSL_accept(ssl)) != 1 && tls_wait(ssl, result) == 0)
+            ;
+
+    if (result != 1) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    return ssl;
+}
+
+int tls_wait(SSL* ssl, int result) {
+    switch (SSL_get_error(ssl, result)) {
+        case SSL_ERROR_WANT_READ:
+            return co_wait(SSL_get_fd(ssl), POLLIN);
+        case SSL_ERROR_WANT_WRITE:
+            return co_wait(SSL_get_fd(ssl), POLLOUT);
+        default:
+            return -1;
+    }
+}
+
+void tls_close(SSL* ssl) {
+    if (!ssl)
+        return;
+
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    ERR_clear_error();
+}
@@ -0,0 +1,36 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <openssl/ssl.h>
+
+/**
+ * Create the server TLS context
+ * @param cert_file PEM certificate chain file
+ * @param key_file PEM private key file
+ * @return 0 on success, non-zero on error
+ */
+int tls_init(const char* cert_file, const char* key_file);
+
+/**
+ * Run the server side of a TLS handshake on an accepted socket
+ * @param fd Connected client socket
+ * @return The TLS session, or NULL if the handshake failed
+ */
+SSL* tls_accept(int fd);
+
+/**
+ * Wait until a TLS operation that failed on a non-blocking socket can be
+ * retried, for at most the socket's SO_RCVTIMEO or SO_SNDTIMEO
+ * @param ssl The TLS session
+ * @param result Return value of the failed operation
+ * @return 0 to retry the operation, -1 if the failure is final
+ */
+int tls_wait(SSL* ssl, int result);
+
+/**
+ * Shut down and free a TLS session
+ * @param ssl The TLS session (may be NULL)
+ */
+void tls_close(SSL* ssl);
+
+#endif /* TLS_H */
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coroutine.h"
+
+#define BUFFER_RECORDS 1024  // Requests each thread buffer remembers
+
+// One committed request. The sequence number works as a seqlock: it is odd
+// while the owning thread rewrites the record, so a dump running at the same
+// time can tell a torn copy from a good one.
+typedef struct {
+    atomic_uint seq;
+    int track;  // Exported as the thread id
+    uint64_t timestamps[TRACE_NUM_PHASES];
+    char path[TRACE_PATH_LENGTH];
+} trace_record_t;
+
+// Ring of records written by a single thread. Buffers are never freed; when
+// their thread exits they are handed to the next thread that needs one, so
+// the number of buffers stays at the peak number of concurrently tracing
+// threads.
+typedef struct trace_buffer {
+    trace_record_t records[BUFFER_RECORDS];
+    atomic_ulong head;   // Total records ever written
+    atomic_int in_use;   // Owned by a live thread
+    struct trace_buffer* next;
+} trace_buffer_t;
+
+static int sample_rate = 0;
+static atomic_ulong request_counter;
+static _Atomic(trace_buffer_t*) all_buffers;
+
+// Fiber-local track number of the running coroutine (or thread)
+static int track_key = -1;
+static atomic_int next_track;
+
+static __thread trace_buffer_t* thread_buffer = NULL;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+
+// Phases are exported as spans covering the time since the previous phase
+static const char* span_names[TRACE_NUM_PHASES] = {
+    [TRACE_FIRST_BYTE] = "wait",    [TRACE_PARSED] = "receive+parse",
+    [TRACE_DISPATCH]   = "route",   [TRACE_HANDLED] = "handler",
+    [TRACE_FORMATTED]  = "format",  [TRACE_SENT] = "send"};
+
+void trace_init(int rate) {
+    sample_rate = rate > 0 ? rate : 0;
+    if (sample_rate && track_key < 0)
+        track_key = coroutine_key_create();
+}
+
+int trace_enabled(void) {
+    return sample_rate > 0;
+}
+
+uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void trace_begin(trace_context_t* context, uint64_t accept_time) {
+    memset(context, 0, sizeof(trace_context_t));
+    if (!sample_rate)
+        return;
+
+    context->sampled = atomic_fetch_add_explicit(&request_counter, 1,
+                                                 memory_order_relaxed) %
+                           sample_rate ==
+                       0;
+    context->timestamps[TRACE_ACCEPT] = accept_time;
+}
+
+void trace_mark(trace_context_t* context, trace_phase_t phase) {
+    if (context->sampled && !context->timestamps[phase])
+        context->timestamps[phase] = trace_now();
+}
+
+void trace_set_path(trace_context_t* context, const char* path) {
+    if (!context->sampled || !path)
+        return;
+    strncpy(context->path, path, TRACE_PATH_LENGTH - 1);
+    context->path[TRACE_PATH_LENGTH - 1] = '\0';
+}
+
+static void release_buffer(void* arg) {
+    trace_buffer_t* buffer = arg;
+    atomic_store_explicit(&buffer->in_use, 0, memory_order_release);
+}
+
+static void create_buffer_key(void) {
+    pthread_key_create(&buffer_key, release_buffer);
+}
+
+// Claim a buffer left behind by an exited thread, or register a new one
+static trace_buffer_t* acquire_buffer(void) {
+    pthread_once(&buffer_key_once, create_buffer_key);
+
+    trace_buffer_t* buffer = atomic_load(&all_buffers);
+    for (; buffer; buffer = buffer->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&buffer->in_use, &expected, 1))
+            break;
+    }
+
+    if (!buffer) {
+        buffer = calloc(1, sizeof(trace_buffer_t));
+        if (!buffer)
+            return NULL;
+        atomic_init(&buffer->in_use, 1);
+        buffer->next = atomic_load(&all_buffers);
+        while (!atomic_compare_exchange_weak(&all_buffers, &buffer->next,
+                                             buffer))
+            ;
+    }
+
+    pthread_setspecific(buffer_key, buffer);
+    return buffer;
+}
+
+// Each connection's requests go on a track of their own in the viewer.
+// Coroutines share their worker's thread id, so with gettid() the
+// overlapping requests of one worker would land on a single track.
+static int current_track(void) {
+    if (track_key < 0)
+        return gettid();
+
+    intptr_t track = (intptr_t)coroutine_get_local(track_key);
+    if (!track) {
+        track = atomic_fetch_add_explicit(&next_track, 1,
+                                          memory_order_relaxed) +
+                1;
+        coroutine_set_local(track_key, (void*)track);
+    }
+    return (int)track;
+}
+
+void trace_end(trace_context_t* context) {
+    if (!context->sampled)
+        return;
+    if (!thread_buffer && !(thread_buffer = acquire_buffer()))
+        return;
+
+    trace_buffer_t* buffer = thread_buffer;
+    unsigned long head =
+        atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    trace_record_t* record = &buffer->records[head % BUFFER_RECORDS];
+
+    unsigned seq = atomic_load_explicit(&record->seq, memory_order_relaxed);
+    atomic_store_explicit(&record->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    record->track = current_track();
+    memcpy(record->timestamps, context->timestamps,
+           sizeof(record->timestamps));
+    memcpy(record->path, context->path, sizeof(record->path));
+
+    atomic_store_explicit(&record->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+// Copy a record, returning 0 if it was being rewritten during the copy
+static int read_record(trace_record_t* record, trace_record_t* copy) {
+    unsigned before = atomic_load_explicit(&record->seq, memory_order_acquire);
+    if (before & 1)
+        return 0;
+
+    copy->track = record->track;
+    memcpy(copy->timestamps, record->timestamps, sizeof(copy->timestamps));
+    memcpy(copy->path, record->path, sizeof(copy->path));
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&record->seq, memory_order_relaxed) == before;
+}
+
+static void write_json_string(FILE* out, const char* string) {
+    fputc('"', out);
+    for (const unsigned char* c = (const unsigned char*)string; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static void write_event(FILE* out, int* first, const char* name,
+                        const char* path, int track, uint64_t start,
+                        uint64_t end) {
+    fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\","
+                 "\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+            *first ? "" : ",", name, (int)getpid(), track, start / 1000.0,
+            (end - start) / 1000.0);
+    if (path) {
+        fputs(",\"args\":{\"path\":", out);
+        write_json_string(out, path);
+        fputc('}', out);
+    }
+    fputc('}', out);
+    *first = 0;
+}
+
+// A request becomes one span covering its whole life, with one nested span
+// per phase that was reached
+static void write_record(FILE* out, int* first, const trace_record_t* record) {
+    const uint64_t* timestamps = record->timestamps;
+    uint64_t start             = timestamps[TRACE_ACCEPT];
+    uint64_t end               = start;
+    for (int i = 1; i < TRACE_NUM_PHASES; i++)
+        if (timestamps[i] > end)
+            end = timestamps[i];
+
+    write_event(out, first, "request", record->path, record->track, start,
+                end);
+
+    uint64_t previous = start;
+    for (int i = 1; i < TRACE_NUM_PHASES; i++) {
+        if (!timestamps[i])
+            continue;
+        write_event(out, first, span_names[i], NULL, record->track, previous,
+                    timestamps[i]);
+        previous = timestamps[i];
+    }
+}
+
+int trace_dump(FILE* out) {
+    int first = 1;
+    int count = 0;
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", out);
+    for (trace_buffer_t* buffer = atomic_load(&all_buffers); buffer;
+         buffer                 = buffer->next) {
+        unsigned long head =
+            atomic_load_explicit(&buffer->head, memory_order_acquire);
+        unsigned long oldest = head > BUFFER_RECORDS ? head - BUFFER_RECORDS
+                                                     : 0;
+        for (unsigned long i = oldest; i < head; i++) {
+            trace_record_t copy;
+            if (!read_record(&buffer->records[i % BUFFER_RECORDS], &copy))
+                continue;
+            write_record(out, &first, &copy);
+            count++;
+        }
+    }
+    fputs("\n]}\n", out);
+
+    return count;
+}
+
+static void* signal_dumper(void* arg) {
+    const char* filename = arg;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    for (;;) {
+        int signal;
+        if (sigwait(&signals, &signal) != 0)
+            continue;
+
+        FILE* out = fopen(filename, "w");
+        if (!out) {
+            perror("Failed to open trace file");
+            continue;
+        }
+        int count = trace_dump(out);
+        fclose(out);
+        printf("Wrote %d traced requests to %s\n", count, filename);
+    }
+    return NULL;
+}
+
+int trace_start_signal_dumper(const char* filename) {
+    // Block SIGUSR1 here so every thread created later inherits the mask and
+    // only the dumper thread ever receives it
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        fprintf(stderr, "Failed to block SIGUSR1\n");
+        return 1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, signal_dumper, (void*)filename) != 0) {
+        perror("Thread creation failed");
+        return 1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
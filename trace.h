@@ -0,0 +1,89 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Points in the life of a request, in order
+typedef enum {
+    TRACE_ACCEPT,
+    TRACE_FIRST_BYTE,
+    TRACE_PARSED,
+    TRACE_DISPATCH,
+    TRACE_HANDLED,
+    TRACE_FORMATTED,
+    TRACE_SENT,
+    TRACE_NUM_PHASES
+} trace_phase_t;
+
+#define TRACE_PATH_LENGTH 64
+
+// Timestamps of one request. Lives on the stack of the connection thread
+// and is only committed to the trace buffers if the request was sampled.
+typedef struct {
+    int sampled;
+    uint64_t timestamps[TRACE_NUM_PHASES];
+    char path[TRACE_PATH_LENGTH];
+} trace_context_t;
+
+/**
+ * Enable tracing of one in every sample_rate requests
+ * @param sample_rate Sampling interval (0 disables tracing)
+ */
+void trace_init(int sample_rate);
+
+/**
+ * Check whether tracing is enabled
+ * @return 1 if enabled, 0 otherwise
+ */
+int trace_enabled(void);
+
+/**
+ * Current monotonic time in nanoseconds
+ * @return The timestamp
+ */
+uint64_t trace_now(void);
+
+/**
+ * Start tracing a request, deciding whether it is sampled
+ * @param context Context to initialize
+ * @param accept_time Time the connection was accepted (from trace_now())
+ */
+void trace_begin(trace_context_t* context, uint64_t accept_time);
+
+/**
+ * Record that a request reached a phase
+ * @param context The request's context
+ * @param phase The phase reached
+ */
+void trace_mark(trace_context_t* context, trace_phase_t phase);
+
+/**
+ * Attach the request path to a trace
+ * @param context The request's context
+ * @param path The request path
+ */
+void trace_set_path(trace_context_t* context, const char* path);
+
+/**
+ * Commit a sampled request to this thread's trace buffer
+ * @param context The request's context
+ */
+void trace_end(trace_context_t* context);
+
+/**
+ * Write all buffered requests as Chrome trace-event JSON
+ * @param out Stream to write to
+ * @return Number of requests written
+ */
+int trace_dump(FILE* out);
+
+/**
+ * Start a thread that dumps the trace to a file on SIGUSR1. Must be called
+ * before any other thread is created.
+ * @param filename File to write the trace to
+ * @return 0 on success, non-zero on error
+ */
+int trace_start_signal_dumper(const char* filename);
+
+#endif /* TRACE_H */
@@ -62,3 +62,36 @@ const char* get_mime_type(const char* filename) {
 
     return "application/octet-stream";
 }
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower((unsigned char)c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+int url_decode(const char* src, char* dst, size_t dst_size) {
+    size_t length = 0;
+
+    // '+' is only a space in query strings, so it is kept as is
+    while (*src) {
+        if (length + 1 >= dst_size)
+            return -1;
+
+        if (*src == '%') {
+            int high = hex_value(src[1]);
+            int low  = high >= 0 ? hex_value(src[2]) : -1;
+            if (low < 0 || (high == 0 && low == 0))
+                return -1;
+            dst[length++]  = (char)(high << 4 | low);
+            src           += 3;
+        } else {
+            dst[length++] = *src++;
+        }
+    }
+
+    dst[length] = '\0';
+    return 0;
+}
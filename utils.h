@@ -2,7 +2,18 @@
 #define UTILS_H
 
 #include <limits.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 const char* get_mime_type(const char* filename);
 
+/**
+ * Decode %XX escapes in a URL path segment
+ * @param src Encoded string
+ * @param dst Buffer for the decoded string
+ * @param dst_size Size of the buffer
+ * @return 0 on success, -1 on an invalid escape or if dst is too small
+ */
+int url_decode(const char* src, char* dst, size_t dst_size);
+
 #endif  // UTILS_H